@@ -30,6 +30,11 @@
 #define RCV_STOP_BIT    4
 #define RCV_STOP_BIT_2  5
 
+// Herstel bij spikes op de ingang
+#define HOLD_NONE	0
+#define HOLD_PART	1	// interval buiten de windows, wacht op volgende overgang
+#define HOLD_MERGE	2	// tel carry op bij volgende interval
+
 // Volgende statussen gelden voor (bijna) alle state machines.
 #define STORE_BIT       0x3F
 #define LVL_SWITCH	0x7E
@@ -63,10 +68,13 @@
 #define T2_MIN          1100U
 #define T2_MAX          1800U
 #define T_1MS		1382U	// 1 ms
+#define T_GLITCH	0U	// spike filter standaard uit, aan met SET_T_GLITCH
+#define T_GLITCH_ON	200U	// ca 145us, kortere pulsen zijn een spike
 
 // Communicatie UART en software buffers
 #define BAUD            115200UL // Baudrate
 #define BUF_SIZE        8        // Send / receive buffer:!!! MOET DEELBAAR ZIJN DOOR 2 !!!
+#define RX_WINDOW	(BUF_SIZE / FRAME_BYTES)	// credits van de host
 #define HOST_CONNECT_RETRY 100	 // Probeer elke N ms contact te krijgen met externe partij
 
 // MASTER -> SLAVE dan is in msb bit 6 gelijk aan 0, voor SLAVE -> MASTER = 1
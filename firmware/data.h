@@ -3,6 +3,21 @@
 
 #include "constants.h"
 
+/*
+ * Toestand van de decoder voor de laatste overgang, om die overgang
+ * terug te kunnen draaien als hij bij een spike blijkt te horen.
+ */
+typedef struct {
+  uint8_t state;
+  uint8_t buff;
+  int8_t i;
+  int8_t msg_bits_cntr;
+  int8_t buff_bits_cntr;
+  uint8_t parity;
+  uint8_t prev_bit;
+  uint16_t value;
+} in_undo_t;
+
 typedef struct {
   uint8_t msg[FRAME_BYTES];
   uint8_t state;
@@ -12,6 +27,10 @@ typedef struct {
   int8_t buff_bits_cntr;
   uint8_t parity;
   uint8_t prev_bit;
+  uint8_t hold;
+  uint8_t recovered;
+  uint16_t carry;
+  in_undo_t undo;
 } in_t;
 
 typedef struct {
@@ -5,12 +5,14 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
+#include <util/atomic.h>
 
 #include "constants.h"
 #include "data.h"
 #include "protocol.h"
 #include "serial.h"
 #include "manchester.h"
+#include "otcodec.h"
 
 volatile uint8_t mode = PASSTHRU;
 
@@ -21,6 +23,86 @@ volatile in_t in_from_boiler;
 
 int main(void)  __attribute__((noreturn));
 
+// ============================== benchmark ==============================
+
+#ifdef BENCH
+
+/*
+ * Meting van de INTERCEPT round trip, van de laatste overgang van een
+ * bericht op FROM_THERM tot de eerste overgang van het antwoord op
+ * TO_THERM (zie BENCH_* in protocol.h en python/otbench.py). Timer 1
+ * wordt bij elke overgang op een ingang gereset, dus de klok is de som
+ * van de uitgelezen waarden van TCNT1 plus 0x10000 per overflow.
+ */
+static volatile uint32_t bench_clock;	// ticks tot de laatste reset van TCNT1
+static uint32_t bench_start, bench_prev;
+static uint8_t bench_next;		// verwacht meetpunt
+static uint16_t bench_run[BENCH_SEND];	// meting in uitvoering
+static uint16_t bench_last[BENCH_TOTAL];	// laatste complete meting
+static uint16_t bench_cnt;
+
+ISR(TIMER1_OVF_vect) {
+  bench_clock += 0x10000UL;
+}
+
+static uint16_t bench_units(uint32_t ticks) {
+  ticks /= BENCH_UNIT;
+  return ticks > 0xFFFF ? 0xFFFF : ticks;
+}
+
+/*
+ * Meetpunt. BENCH_COUNT begint een nieuwe meting, de andere tellen
+ * alleen direct na het vorige meetpunt. Bij BENCH_SEND is de meting
+ * compleet.
+ */
+void bench_mark(uint8_t point) {
+  uint16_t t1;
+  uint32_t now;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    t1 = TCNT1;
+    now = bench_clock + t1;
+    if ((TIFR & (1 << TOV1)) && t1 < 0x8000) {	// overflow, ISR nog niet geweest
+      now += 0x10000UL;
+    }
+    if (point == BENCH_COUNT || point == bench_next) {
+      if (point == BENCH_COUNT) {
+	bench_start = now;
+      } else {
+	bench_run[point - 1] = bench_units(now - bench_prev);
+      }
+      bench_prev = now;
+      bench_next = point + 1;
+      if (point == BENCH_SEND) {
+	for (uint8_t i = 0; i < BENCH_SEND; i++) {
+	  bench_last[i] = bench_run[i];
+	}
+	bench_last[BENCH_TOTAL - 1] = bench_units(now - bench_start);
+	++ bench_cnt;
+      }
+    }
+  }
+}
+
+void bench_get(uint8_t msg[]) {
+  uint16_t value = 0;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (msg[2] == BENCH_COUNT) {
+      value = bench_cnt;
+    } else if (msg[2] <= BENCH_TOTAL) {
+      value = bench_last[msg[2] - 1];
+    }
+  }
+  msg[2] = value >> 8;
+  msg[3] = value & 0xFF;
+}
+
+#define BENCH_MARK(point) bench_mark(point)
+#else
+#define BENCH_MARK(point)
+#endif /* BENCH */
+
 void init(void) {
 
   // Outputs.
@@ -59,6 +141,9 @@ void init(void) {
   TCCR1B |= ((0 << CS12) | (1 << CS11) | (0 << CS10)); // prescaler set to 8
   OCR1A = T_1MS * 2; // timeout = signaal out of sync
   TIMSK |= (1 << OCIE1A); // enable timeout interrupt
+#ifdef BENCH
+  TIMSK |= (1 << TOIE1); // overflow voor de klok van bench_mark()
+#endif
 
   /*
    * Initialiseer de UART. Met de Raspberry pi en een 12MHz
@@ -86,32 +171,6 @@ void init(void) {
 }
 
 
-/*
- * http://www-graphics.stanford.edu/~seander/bithacks.html#ParityParallel
- * 
-
-unsigned int v; // word value to compute the parity of 
- v ^= v >> 16; 
- v ^= v >> 8; 
- v ^= v >> 4; 
- v &= 0xf; 
-return (0x6996 >> v) & 1;
-
- * TODO: Optimaliseer de laatste shifts omdat dit door de compiler
- * toch nog omgezet wordt naar een loop. Ook zou de aanroep mooier
- * kunnen met een pointer naar de array en lokale variabelen.
- */
-uint8_t parity32(volatile uint8_t *bytes) {
-  uint8_t byte3 = bytes[2];
-  uint8_t byte4 = bytes[3];
-  byte3 ^= bytes[0];
-  byte4 ^= bytes[1];
-  byte4 ^= byte3;
-  byte4 ^= byte4 >> 4;
-  byte4 &= 0x0F;
-  return (0x6996 >> byte4) & 1;
-}
-
 // ============================== zenden ==============================
 
 /*
@@ -128,7 +187,7 @@ void send(uint8_t *msg) {
   volatile out_t* out;
 
   // bit 6 = 0 == Master to slave == thermostaat naar ketel
-  dir = msg[0] & (1 << MSTR_TO_SLV_BIT);
+  dir = OT_FROM_SLAVE(msg);
   if (dir) {
     out = &out_to_therm;
   } else {
@@ -137,7 +196,7 @@ void send(uint8_t *msg) {
   for (uint8_t i = 0; i < FRAME_BYTES; i++) {
     out->msg[i] = msg[i];
   }
-  out->msg[0] |= (parity32(out->msg) << 7);
+  out->msg[0] |= (ot_parity(out->msg) << 7);
   out->state = START;
   if (dir) {
     TIMSK |= (1 << OCIE0B); // Enable klok 0 interrupt compare B
@@ -152,6 +211,9 @@ ISR(TIMER0_COMPA_vect) {
 
 ISR(TIMER0_COMPB_vect) {
   manch_encode(&out_to_therm, (1 << TO_THERM), (1 << OCIE0B));
+  if (out_to_therm.state == SEND_START_BIT && out_to_therm.clock_half == ONE) {
+    BENCH_MARK(BENCH_SEND);		// eerste overgang
+  }
 }
 
 
@@ -169,6 +231,9 @@ void in_handler(volatile in_t *in, uint8_t in_mask, uint8_t out_mask) {
    */
   tc1_value = TCNT1;
   TCNT1 = 0; // reset timer 1 counter.
+#ifdef BENCH
+  bench_clock += tc1_value;
+#endif
 
   switch (mode) {
   case INTERCEPT:
@@ -177,8 +242,10 @@ void in_handler(volatile in_t *in, uint8_t in_mask, uint8_t out_mask) {
     if (in->state == DONE) {  		// Hele bericht binnen?
       if (in->parity) {			// Als oneven aantal bits gelezen?
 	in->state = PARITY_ERROR;	// hebben we een parity error.
-      } else {
-	in->msg[0] &= 0x7F; 		// Haal parity bit weg.
+      } else {				// Parity bit blijft staan voor de host.
+	if (in == &in_from_therm) {
+	  BENCH_MARK(BENCH_COUNT);
+	}
       }
     }
     if (mode == INTERCEPT) {
@@ -269,6 +336,16 @@ void send_msg_to_host(uint8_t msg[]) {
   }
 }
 
+/*
+ * Een HOST_TO_GW bericht van de gw zelf, zoals CREDIT en OVERRUN.
+ */
+void send_cmd_to_host(uint8_t cmd, uint8_t msb, uint8_t lsb) {
+  uputc(HOST_TO_GW);
+  uputc(cmd);
+  uputc(msb);
+  uputc(lsb);
+}
+
 // ============================== set mode ==============================
 
 /* 
@@ -345,7 +422,41 @@ void process_cmd(uint8_t msg[]) {
     msg[2] = t2_max.valueh;
     msg[3] = t2_max.valuel;
     break;
+  case SET_T_GLITCH:
+    t_glitch.valueh = msg[2];
+    t_glitch.valuel = msg[3];
+  case GET_T_GLITCH:
+    msg[2] = t_glitch.valueh;
+    msg[3] = t_glitch.valuel;
+    break;
+  case SET_GLITCH_CNT:
+    glitch_cntr.valueh = msg[2];
+    glitch_cntr.valuel = msg[3];
+  case GET_GLITCH_CNT:
+    msg[2] = glitch_cntr.valueh;
+    msg[3] = glitch_cntr.valuel;
+    break;
+  case SET_SAVED_CNT:
+    saved_cntr.valueh = msg[2];
+    saved_cntr.valuel = msg[3];
+  case GET_SAVED_CNT:
+    msg[2] = saved_cntr.valueh;
+    msg[3] = saved_cntr.valuel;
+    break;
+  case SET_OVERRUN_CNT:
+    overrun_cntr.valueh = msg[2];
+    overrun_cntr.valuel = msg[3];
+  case GET_OVERRUN_CNT:
+    msg[2] = overrun_cntr.valueh;
+    msg[3] = overrun_cntr.valuel;
+    break;
+#ifdef BENCH
+  case GET_BENCH:
+    bench_get(msg);
+    break;
+#endif
   default:
+    msg[2] = msg[1];	// zodat de host weet welk commando
     msg[1] = UNKNOWN_DATAID; // Onbekend commando, laat externe dat ook weten
   }
   send_msg_to_host(msg);
@@ -369,8 +480,11 @@ ISR(WDT_OVERFLOW_vect) {
 int main(void) {
 
   uint8_t msg[FRAME_BYTES];
-  uint8_t i;
+  uint8_t host_msg[FRAME_BYTES];	// bericht van host in opbouw
+  uint8_t i = 0;			// bytes van host_msg
   uint8_t c;
+  uint8_t syn = 0;			// SYN's achter elkaar
+  uint8_t resync = 0;			// na overrun, wacht op SYN frame
 
   /* 
    * If a reset was caused by the Watchdog Timer, clear the WDT reset
@@ -403,8 +517,11 @@ int main(void) {
 	} while (!(ugetc_nb(&c)));
       } while (c != SYN);
 
+      ugetc_flush();	// Geen oude overrun meenemen
       uputc(ACK); 	// Acknowledge
       i = 0;
+      syn = 0;
+      resync = 0;
       set_mode(MONITOR);
 
     } else {
@@ -420,18 +537,55 @@ int main(void) {
        * regelmaat iets binnenkrijgen van de externe host, resetten we
        * de watchdog timer op tijd om niet terug naar de PASSTHRU mode
        * te gaan.
+       *
+       * Is er een karakter verloren gegaan, dan klopt de telling i
+       * niet meer. Gooi dan het halve bericht en cb_in weg, laat de
+       * host dat weten en sla alles over tot de host met FRAME_BYTES
+       * SYN's achter elkaar aangeeft waar het volgende bericht
+       * begint. Een losse SYN kan ook een data byte zijn, maar vier
+       * niet: het eerste byte van een bericht heeft de spare bits 0
+       * en SYN niet. Een eerste byte met parity of spare bits gezet
+       * kan geen begin van een bericht zijn en wordt ook overgeslagen.
+       *
+       * Het SYN frame geldt altijd, ook zonder overrun: heeft de host
+       * een credit gemist, dan krijgt hij zo alle credits terug.
+       * Staan er nog SYN's als data voor, dan komt het SYN frame een
+       * paar bytes eerder en worden de laatste SYN's als eerste byte
+       * overgeslagen.
        */
-      if (ugetc_nb(&c)) {		// Nieuw karakter?
-	msg[i] = c;			// plaats in buffer
-	if (i == FRAME_BYTES - 1) { 	// Bericht binnen?
+      if (rx_overrun) {
+	ugetc_flush();
+	i = 0;
+	syn = 0;
+	resync = 1;
+	send_cmd_to_host(OVERRUN, overrun_cntr.valueh, overrun_cntr.valuel);
+      } else if (ugetc_nb(&c)) {	// Nieuw karakter?
+	syn = (c == SYN) ? syn + 1 : 0;
+	if (syn == FRAME_BYTES) {	// SYN frame
+	  syn = 0;
+	  i = 0;
+	  resync = 0;
+	  wdt_reset();
+	  send_cmd_to_host(CREDIT, SYN, RX_WINDOW);
+	} else if (resync) {
+	  // Wacht op het SYN frame.
+	} else if (i == 0 && (c & 0x8F)) {
+	  // Geen begin van een bericht, sla over.
+	} else if (i == FRAME_BYTES - 1) { 	// Bericht binnen?
+	  host_msg[i] = c;
 	  wdt_reset();			// Hond in zijn hok
-	  if ((msg[0] & MSGID_MSK) == HOST_TO_GW) { // Bwericht voor gw bedoeld?
-	    process_cmd(msg);
+	  if ((host_msg[0] & MSGID_MSK) == HOST_TO_GW) { // Bwericht voor gw bedoeld?
+	    process_cmd(host_msg);
 	  } else {
-	    send(msg);			// Stuur door naar MASTER of SLAVE
+	    if (OT_FROM_SLAVE(host_msg)) {
+	      BENCH_MARK(BENCH_HOST);
+	    }
+	    send(host_msg);		// Stuur door naar MASTER of SLAVE
+	    send_cmd_to_host(CREDIT, 0, 1);
 	  }
 	  i = 0;
 	} else {
+	  host_msg[i] = c;		// plaats in buffer
 	  ++ i;
 	}
       }
@@ -446,7 +600,9 @@ int main(void) {
      */
     if (mode != PASSTHRU) {
       if (receive(&in_from_therm, msg)) {
+	BENCH_MARK(BENCH_RECEIVE);
 	send_msg_to_host(msg);
+	BENCH_MARK(BENCH_TO_HOST);
       }
       if (receive(&in_from_boiler, msg)) {
 	send_msg_to_host(msg);
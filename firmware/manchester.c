@@ -76,6 +76,9 @@ volatile Uint16_2x8_t t_min = { T_MIN };
 volatile Uint16_2x8_t t_max = { T_MAX };
 volatile Uint16_2x8_t t2_min = { T2_MIN };
 volatile Uint16_2x8_t t2_max = { T2_MAX };
+volatile Uint16_2x8_t t_glitch = { T_GLITCH };
+volatile Uint16_2x8_t glitch_cntr = { 0 };
+volatile Uint16_2x8_t saved_cntr = { 0 };
 
 /*
  * Ontvang een bitstream en decodeer deze volgens Manchester.  TODO:
@@ -86,7 +89,7 @@ volatile Uint16_2x8_t t2_max = { T2_MAX };
  * oneven is. Kan als return value worden teruggegeven waarna het
  * uitvoeren van een parity check niet meer nodig is.
  */
-void manch_decode(volatile in_t *in, uint16_t tc1_value) {
+static void manch_step(volatile in_t *in, uint16_t tc1_value) {
 
 #define UNDEFINED 0
 #define SHORT 1
@@ -107,6 +110,7 @@ void manch_decode(volatile in_t *in, uint16_t tc1_value) {
   switch (in->state) {
   case WAITING:
     in->state = RCV_START_BIT;
+    in->recovered = 0;
     PORTB |= (1 << LED3);
     break;
   case RCV_START_BIT:  // Dit valt op overgang halverwege bit frame
@@ -190,3 +194,83 @@ void manch_decode(volatile in_t *in, uint16_t tc1_value) {
   }
   //return in->parity;
 }
+
+static void save_undo(volatile in_t *in, uint16_t tc1_value) {
+  in->undo.state = in->state;
+  in->undo.buff = in->buff;
+  in->undo.i = in->i;
+  in->undo.msg_bits_cntr = in->msg_bits_cntr;
+  in->undo.buff_bits_cntr = in->buff_bits_cntr;
+  in->undo.parity = in->parity;
+  in->undo.prev_bit = in->prev_bit;
+  in->undo.value = tc1_value;
+}
+
+static void undo(volatile in_t *in) {
+  in->state = in->undo.state;
+  in->buff = in->undo.buff;
+  in->i = in->undo.i;
+  in->msg_bits_cntr = in->undo.msg_bits_cntr;
+  in->buff_bits_cntr = in->undo.buff_bits_cntr;
+  in->parity = in->undo.parity;
+  in->prev_bit = in->undo.prev_bit;
+}
+
+/*
+ * Spike filter voor manch_step(). Een spike op de lijn geeft twee
+ * overgangen vlak na elkaar en zonder filter gaat dan het hele
+ * bericht verloren. Een interval korter dan t_glitch is de spike
+ * zelf: de vorige overgang wordt teruggedraaid en beide overgangen
+ * worden genegeerd door de tijd op te tellen bij het volgende
+ * interval. Een interval dat in geen window valt, tussen t_glitch en
+ * t_min of tussen t_max en t2_min, kan het stuk voor een spike zijn en
+ * wordt vastgehouden tot de volgende overgang; is dat geen spike, dan
+ * is het alsnog een SYNC_ERROR. Zonder vasthouden zou manch_step() al
+ * naar WAITING gaan voor de spike binnen is. Er wordt maar een
+ * keer achter elkaar hersteld. Met t_glitch = 0 werkt de decoder als
+ * voorheen. In glitch_cntr het aantal weggefilterde spikes en in
+ * saved_cntr het aantal berichten dat zo gered is.
+ */
+void manch_decode(volatile in_t *in, uint16_t tc1_value) {
+  uint8_t merged = 0;
+
+  switch (in->state) {
+  case WAITING:
+  case DONE:
+    in->hold = HOLD_NONE;
+    break;
+  default:
+    if (in->hold == HOLD_MERGE) {
+      tc1_value += in->carry;
+      in->hold = HOLD_NONE;
+      merged = 1;
+    } else if (tc1_value < t_glitch.value) {
+      ++ glitch_cntr.value;
+      if (in->hold == HOLD_PART) {
+	in->carry += tc1_value;
+      } else {
+	undo(in);
+	in->carry = in->undo.value + tc1_value;
+      }
+      in->hold = HOLD_MERGE;
+      return;
+    } else if (in->hold == HOLD_PART) {
+      in->hold = HOLD_NONE;
+      in->state = WAITING;  // Geen spike, het korte interval was fout.
+    } else if (tc1_value < t_min.value ||
+	       (tc1_value > t_max.value && tc1_value < t2_min.value)) {
+      in->carry = tc1_value;
+      in->hold = HOLD_PART;
+      return;
+    }
+  }
+
+  save_undo(in, tc1_value);
+  manch_step(in, tc1_value);
+  if (merged) {
+    in->recovered = 1;
+  }
+  if (in->state == DONE && in->recovered && !in->parity) {
+    ++ saved_cntr.value;
+  }
+}
@@ -0,0 +1,176 @@
+#include "otcodec.h"
+
+/*
+ * Parity over de 32 bits van een frame, de parity bit zelf moet 0
+ * zijn.
+ *
+ * http://www-graphics.stanford.edu/~seander/bithacks.html#ParityParallel
+ * 
+
+unsigned int v; // word value to compute the parity of 
+ v ^= v >> 16; 
+ v ^= v >> 8; 
+ v ^= v >> 4; 
+ v &= 0xf; 
+return (0x6996 >> v) & 1;
+
+ * TODO: Optimaliseer de laatste shifts omdat dit door de compiler
+ * toch nog omgezet wordt naar een loop. Ook zou de aanroep mooier
+ * kunnen met een pointer naar de array en lokale variabelen.
+ */
+uint8_t ot_parity(const volatile uint8_t *msg) {
+  uint8_t byte3 = msg[2];
+  uint8_t byte4 = msg[3];
+  byte3 ^= msg[0];
+  byte4 ^= msg[1];
+  byte4 ^= byte3;
+  byte4 ^= byte4 >> 4;
+  byte4 &= 0x0F;
+  return (0x6996 >> byte4) & 1;
+}
+
+#ifndef __AVR__
+
+/*
+ * ot_build() is inline, dit is dezelfde code als functie voor
+ * libotcodec.so.
+ */
+void ot_build_frame(uint8_t *msg, uint8_t type, uint8_t id, uint16_t value) {
+  ot_build(msg, type, id, value);
+}
+
+/*
+ * Types van de DataIDs uit de OpenTherm specificatie 2.2. Niet
+ * genoemde DataIDs zijn OT_NONE.
+ */
+static const uint8_t ot_types[128] = {
+  [0] = OT_PAIR(OT_FLAG8, OT_FLAG8),	// Status
+  [1] = OT_F88,				// TSet
+  [2] = OT_PAIR(OT_FLAG8, OT_U8),	// M-Config / M-MemberIDcode
+  [3] = OT_PAIR(OT_FLAG8, OT_U8),	// S-Config / S-MemberIDcode
+  [4] = OT_PAIR(OT_U8, OT_U8),		// Command
+  [5] = OT_PAIR(OT_FLAG8, OT_U8),	// ASF-flags / OEM-fault-code
+  [6] = OT_PAIR(OT_FLAG8, OT_FLAG8),	// RBP-flags
+  [7] = OT_F88,				// Cooling-control
+  [8] = OT_F88,				// TsetCH2
+  [9] = OT_F88,				// TrOverride
+  [10] = OT_PAIR(OT_U8, OT_U8),		// TSP
+  [11] = OT_PAIR(OT_U8, OT_U8),		// TSP-index / TSP-value
+  [12] = OT_PAIR(OT_U8, OT_U8),		// FHB-size
+  [13] = OT_PAIR(OT_U8, OT_U8),		// FHB-index / FHB-value
+  [14] = OT_F88,			// Max-rel-mod-level-setting
+  [15] = OT_PAIR(OT_U8, OT_U8),		// Max-Capacity / Min-Mod-Level
+  [16] = OT_F88,			// TrSet
+  [17] = OT_F88,			// Rel.-mod-level
+  [18] = OT_F88,			// CH-pressure
+  [19] = OT_F88,			// DHW-flow-rate
+  [20] = OT_PAIR(OT_U8, OT_U8),		// Day-Time
+  [21] = OT_PAIR(OT_U8, OT_U8),		// Date
+  [22] = OT_U16,			// Year
+  [23] = OT_F88,			// TrSetCH2
+  [24] = OT_F88,			// Tr
+  [25] = OT_F88,			// Tboiler
+  [26] = OT_F88,			// Tdhw
+  [27] = OT_F88,			// Toutside
+  [28] = OT_F88,			// Tret
+  [29] = OT_F88,			// Tstorage
+  [30] = OT_F88,			// Tcollector
+  [31] = OT_F88,			// TflowCH2
+  [32] = OT_F88,			// Tdhw2
+  [33] = OT_S16,			// Texhaust
+  [48] = OT_PAIR(OT_S8, OT_S8),		// TdhwSet-UB / TdhwSet-LB
+  [49] = OT_PAIR(OT_S8, OT_S8),		// MaxTSet-UB / MaxTSet-LB
+  [50] = OT_PAIR(OT_S8, OT_S8),		// Hcratio-UB / Hcratio-LB
+  [56] = OT_F88,			// TdhwSet
+  [57] = OT_F88,			// MaxTSet
+  [58] = OT_F88,			// Hcratio
+  [100] = OT_PAIR(OT_FLAG8, OT_U8),	// Remote override function
+  [115] = OT_U16,			// OEM diagnostic code
+  [116] = OT_U16,			// Burner starts
+  [117] = OT_U16,			// CH pump starts
+  [118] = OT_U16,			// DHW pump/valve starts
+  [119] = OT_U16,			// DHW burner starts
+  [120] = OT_U16,			// Burner operation hours
+  [121] = OT_U16,			// CH pump operation hours
+  [122] = OT_U16,			// DHW pump/valve operation hours
+  [123] = OT_U16,			// DHW burner operation hours
+  [124] = OT_F88,			// OpenTherm version Master
+  [125] = OT_F88,			// OpenTherm version Slave
+  [126] = OT_PAIR(OT_U8, OT_U8),	// Master-version
+  [127] = OT_PAIR(OT_U8, OT_U8),	// Slave-version
+};
+
+uint8_t ot_data_type(uint8_t id) {
+  return id < sizeof(ot_types) ? ot_types[id] : OT_NONE;
+}
+
+/*
+ * Byte volgens een type uit de tabel, S8 met teken en FLAG8 en U8 als
+ * 0 - 255.
+ */
+static double ot_byte(uint8_t type, uint8_t b) {
+  return type == OT_S8 ? (int8_t) b : b;
+}
+
+/*
+ * Waarde van een frame volgens het type van de DataID. Bij twee losse
+ * bytes is dat het hb, het lb geeft ot_value_lb(). Onbekende DataIDs
+ * geven de ruwe 16 bit waarde.
+ */
+double ot_value(const uint8_t *msg) {
+  uint8_t type = ot_data_type(OT_DATA_ID(msg));
+  uint16_t raw = OT_VALUE(msg);
+
+  switch (type) {
+  case OT_F88:
+    return (int16_t) raw / 256.0;
+  case OT_S16:
+    return (int16_t) raw;
+  case OT_U16:
+  case OT_NONE:
+    return raw;
+  }
+  return ot_byte(type >> 4, msg[2]);
+}
+
+/*
+ * Het lb van een frame met twee losse bytes, volgens het type van de
+ * DataID. 0 bij 16 bit waarden en onbekende DataIDs.
+ */
+double ot_value_lb(const uint8_t *msg) {
+  uint8_t type = ot_data_type(OT_DATA_ID(msg));
+
+  if (type == OT_NONE || (type >> 4) == OT_WORD) {
+    return 0;
+  }
+  return ot_byte(type & 0x0F, msg[3]);
+}
+
+/*
+ * Decodeer n frames achter elkaar in 'frames' naar losse arrays, voor
+ * de host. Een array mag NULL zijn als het niet nodig is. Geeft n
+ * terug.
+ */
+size_t ot_decode(const uint8_t *frames, size_t n,
+		 uint8_t *type, uint8_t *id, uint16_t *raw, double *value, double *lb) {
+  for (size_t k = 0; k < n; k++, frames += OT_FRAME_BYTES) {
+    if (type) {
+      type[k] = OT_MSG_TYPE(frames);
+    }
+    if (id) {
+      id[k] = OT_DATA_ID(frames);
+    }
+    if (raw) {
+      raw[k] = OT_VALUE(frames);
+    }
+    if (value) {
+      value[k] = ot_value(frames);
+    }
+    if (lb) {
+      lb[k] = ot_value_lb(frames);
+    }
+  }
+  return n;
+}
+
+#endif /* __AVR__ */
@@ -0,0 +1,76 @@
+#ifndef OTCODEC_H_
+#define OTCODEC_H_
+
+/*
+ * OpenTherm frames: opbouwen, uit elkaar halen, parity en DataID
+ * types. Wordt zowel in de firmware gebruikt als op de host
+ * (python/otcodec.py via libotcodec.so). Een frame is 4 bytes, msb
+ * eerst:
+ *
+ *   msg[0]  P MMM SSSS  parity, msg-type, spare
+ *   msg[1]  DataID
+ *   msg[2]  data-value hb
+ *   msg[3]  data-value lb
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OT_FRAME_BYTES  4
+
+// msg-type, bit 2 is de richting: 0 = master -> slave
+#define OT_READ_DATA      0
+#define OT_WRITE_DATA     1
+#define OT_INVALID_DATA   2
+#define OT_RESERVED       3
+#define OT_READ_ACK       4
+#define OT_WRITE_ACK      5
+#define OT_DATA_INVALID   6
+#define OT_UNKNOWN_DATAID 7
+
+#define OT_MSG_TYPE(msg)   (((msg)[0] >> 4) & 0x07)
+#define OT_FROM_SLAVE(msg) ((msg)[0] & 0x40)
+#define OT_DATA_ID(msg)    ((msg)[1])
+#define OT_VALUE(msg)      (((uint16_t) (msg)[2] << 8) | (msg)[3])
+
+uint8_t ot_parity(const volatile uint8_t *msg);
+
+/*
+ * Frame opbouwen, inclusief parity bit. Inline zodat het in de
+ * firmware alleen flash kost als het gebruikt wordt.
+ */
+static inline void ot_build(volatile uint8_t *msg, uint8_t type, uint8_t id, uint16_t value) {
+  msg[0] = (type & 0x07) << 4;
+  msg[1] = id;
+  msg[2] = value >> 8;
+  msg[3] = value & 0xFF;
+  msg[0] |= ot_parity(msg) << 7;
+}
+
+#ifndef __AVR__
+
+/*
+ * Data types per DataID. Hoge nibble voor het hb, lage voor het lb;
+ * bij 16 bit waarden is de hoge nibble OT_WORD.
+ */
+#define OT_NONE   0x0	// onbekende DataID
+#define OT_FLAG8  0x1
+#define OT_U8     0x2
+#define OT_S8     0x3
+#define OT_WORD   0xF
+
+#define OT_PAIR(hb, lb) (((hb) << 4) | (lb))
+#define OT_F88    OT_PAIR(OT_WORD, 0x1)
+#define OT_U16    OT_PAIR(OT_WORD, 0x2)
+#define OT_S16    OT_PAIR(OT_WORD, 0x3)
+
+void ot_build_frame(uint8_t *msg, uint8_t type, uint8_t id, uint16_t value);
+uint8_t ot_data_type(uint8_t id);
+double ot_value(const uint8_t *msg);
+double ot_value_lb(const uint8_t *msg);
+size_t ot_decode(const uint8_t *frames, size_t n,
+		 uint8_t *type, uint8_t *id, uint16_t *raw, double *value, double *lb);
+
+#endif /* __AVR__ */
+
+#endif /* OTCODEC_H_ */
@@ -21,7 +21,33 @@
 // OpernTherm data-id = second bye
 #define GET_SET_FLG	0x80
 
-// Dit zijn commando's tussen gw en externe controller
+/*
+ * Dit zijn commando's tussen gw en externe controller.
+ *
+ * OpenTherm berichten naar de host houden het ontvangen parity bit,
+ * zodat de host een bericht dat een paar bytes verschoven is kan
+ * herkennen. Berichten van de host en HOST_TO_GW berichten hebben
+ * geen parity bit; de gw zet het zelf bij het versturen.
+ *
+ * Flow control host -> gw: cb_in heeft plaats voor RX_WINDOW
+ * berichten. Na de handshake heeft de host dat aantal credits en elk
+ * bericht naar de gw kost er een. Elk HOST_TO_GW bericht van de gw
+ * geeft er een terug: het antwoord op een commando of, na een
+ * OpenTherm bericht, een CREDIT bericht met msg[3] = 1.
+ *
+ * Bij een overrun gooit de gw cb_in en het halve bericht weg, meldt
+ * OVERRUN met in msg[2..3] het aantal overruns en slaat alles over
+ * tot de host een SYN frame stuurt: FRAME_BYTES keer SYN. Dat kan
+ * niet in een reeks berichten voorkomen, want elk eerste byte heeft
+ * de spare bits 0. Dan weet de gw weer waar een bericht begint en
+ * geeft hij de host met CREDIT, msg[2] = SYN en msg[3] = RX_WINDOW,
+ * weer alle credits. Andere credits tellen dan niet meer. De gw
+ * accepteert een SYN frame altijd, dus ook een host die een credit
+ * of antwoord gemist heeft stuurt er een na een timeout.
+ *
+ * Op een onbekend commando antwoordt de gw met UNKNOWN_DATAID in
+ * msg[1] en het onbekende commando in msg[2].
+ */
 #define EOS 		0x01
 #define PING		0x02
 #define RESTART		0x03
@@ -54,6 +80,31 @@
 #define SET_SYN_ERR_CNT	0x92
 #define GET_TEST	0x13
 #define SET_TEST	0x93
+#define GET_T_GLITCH	0x14
+#define SET_T_GLITCH	0x94
+#define GET_GLITCH_CNT	0x15
+#define SET_GLITCH_CNT	0x95
+#define CREDIT		0x17	// gw -> host: ruimte voor een bericht meer
+#define OVERRUN		0x18	// gw -> host: cb_in overgelopen en geleegd
+#define GET_OVERRUN_CNT	0x19
+#define SET_OVERRUN_CNT	0x99
+#define GET_BENCH	0x1A	// alleen met -DBENCH, msg[2] = BENCH_*
+#define GET_SAVED_CNT	0x1B	// niet 0x16, dat is SYN
+#define SET_SAVED_CNT	0x9B
+
+/*
+ * Meetpunten van de INTERCEPT round trip voor GET_BENCH. Elke waarde
+ * is de tijd sinds het vorige meetpunt in de laatste complete meting,
+ * in eenheden van BENCH_UNIT ticks van timer 1 (ca 11.6 us).
+ * BENCH_COUNT geeft het aantal complete metingen.
+ */
+#define BENCH_UNIT	16
+#define BENCH_COUNT	0	// laatste overgang bericht op FROM_THERM
+#define BENCH_RECEIVE	1	// -> receive() in de main loop
+#define BENCH_TO_HOST	2	// -> laatste byte in cb_out
+#define BENCH_HOST	3	// -> antwoord van de host compleet in de main loop
+#define BENCH_SEND	4	// -> eerste overgang op TO_THERM
+#define BENCH_TOTAL	5	// laatste overgang FROM_THERM -> eerste TO_THERM
 #define DO_TEST		0xFF
 
 #endif /* PROTOCOL_H_ */
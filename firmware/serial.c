@@ -12,6 +12,9 @@
 volatile cb_t cb_in = { 0, 0, 0, {} };
 volatile cb_t cb_out = { 0, 0, 0, {} };
 
+volatile uint8_t rx_overrun = 0;
+volatile Uint16_2x8_t overrun_cntr = { 0 };
+
 /* BELANGRIJK: De grootte van de buffer moet een macht van twee zijn
  * omdat bij de 'wrap around' de modulo door een AND functie wordt
  * gebruikt en bij foute waarden de boel verschrikkelijk mis gaat.
@@ -128,15 +131,32 @@ uint8_t ugetc_nb(uint8_t *c) {
   }
 }
 
+/*
+ * Gooi alles in cb_in weg, na een overrun. De main loop moet dan ook
+ * het half ontvangen bericht weggooien.
+ */
+void ugetc_flush(void) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    cb_in.start = cb_in.count = 0;
+    rx_overrun = 0;
+  }
+}
+
 /*
  * Character ontvangen interrupt. Plaats character in (ring)buffer als
- * er plaats is.
+ * er plaats is. Als de buffer vol is of de USART een overrun of
+ * frame error meldt, is er een karakter verloren en zet rx_overrun
+ * de main loop aan het werk. UCSRA moet voor UDR gelezen worden.
  */
 ISR(USART_RX_vect) {
-  uint8_t c;
+  uint8_t c, err;
   
+  err = UCSRA & ((1 << DOR) | (1 << FE));
   c = UDR;
-  cb_putc(&cb_in, c);
+  if (err || cb_putc(&cb_in, c) == 0) {
+    rx_overrun = 1;
+    ++ overrun_cntr.value;
+  }
 }
 
 
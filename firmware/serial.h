@@ -2,6 +2,7 @@
 #define SERIAL_H_
 
 #include "constants.h"
+#include "data.h"
 
 /* Circular buffer type */
 typedef struct {
@@ -14,5 +15,9 @@ typedef struct {
 void uputc(uint8_t c);
 void uputs(uint8_t *s);
 uint8_t ugetc_nb(uint8_t *c);
+void ugetc_flush(void);
+
+extern volatile uint8_t rx_overrun;
+extern volatile Uint16_2x8_t overrun_cntr;
 
 #endif /* SERIAL_H_ */
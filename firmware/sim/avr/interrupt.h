@@ -0,0 +1,28 @@
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+/*
+ * Interrupts in de simulator: de hardware draait in een signal
+ * handler die de firmware op elk moment kan onderbreken, net als een
+ * echte interrupt. cli() / sei() blokkeren / deblokkeren dat signaal.
+ */
+
+void sim_cli(void);
+void sim_sei(void);
+
+#define cli() sim_cli()
+#define sei() sim_sei()
+
+#define ISR(vector) void vector(void); void vector(void)
+
+void INT0_vect(void);
+void INT1_vect(void);
+void TIMER0_COMPA_vect(void);
+void TIMER0_COMPB_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER1_OVF_vect(void);
+void USART_RX_vect(void);
+void USART_UDRE_vect(void);
+void WDT_OVERFLOW_vect(void);
+
+#endif /* SIM_AVR_INTERRUPT_H_ */
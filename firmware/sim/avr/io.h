@@ -0,0 +1,85 @@
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+/*
+ * Nagebootste registers van de ATtiny4313 voor de simulator. De
+ * meeste registers zijn gewoon variabelen, alleen TCNT1, UCSRA en UDR
+ * lopen via de simulator omdat die van de tijd afhangen of omdat
+ * schrijven er een actie van de hardware tot gevolg heeft.
+ */
+
+#include <stdint.h>
+
+extern volatile uint8_t PORTB, DDRB, PINB;
+extern volatile uint8_t PORTD, DDRD, PIND;
+extern volatile uint8_t MCUCR, GIMSK, MCUSR, WDTCR;
+extern volatile uint8_t TCCR0A, TCCR0B, OCR0A, OCR0B, TIMSK, TIFR;
+extern volatile uint8_t TCCR1A, TCCR1B;
+extern volatile uint16_t OCR1A;
+extern volatile uint8_t UBRRH, UBRRL, UCSRB, UCSRC;
+
+volatile uint32_t *sim_tcnt1(void);
+volatile uint8_t *sim_ucsra(void);
+volatile uint16_t *sim_udr(void);
+
+#define TCNT1	(*sim_tcnt1())
+#define UCSRA	(*sim_ucsra())
+#define UDR	(*sim_udr())
+
+// PORTB / PORTD
+#define PB2	2
+#define PB3	3
+#define PB4	4
+#define PD2	2
+#define PD3	3
+#define PD4	4
+#define PD5	5
+#define PD6	6
+
+// MCUCR / GIMSK
+#define ISC00	0
+#define ISC01	1
+#define ISC10	2
+#define ISC11	3
+#define INT0	6
+#define INT1	7
+
+// MCUSR / WDTCR
+#define WDRF	3
+#define WDE	3
+#define WDCE	4
+
+// Timers
+#define WGM01	1
+#define CS00	0
+#define CS01	1
+#define CS02	2
+#define CS10	0
+#define CS11	1
+#define CS12	2
+#define OCIE0A	0
+#define OCIE0B	2
+#define OCIE1A	6
+#define TOIE1	7
+#define TOV1	7
+
+// USART
+#define MPCM	0
+#define U2X	1
+#define UPE	2
+#define DOR	3
+#define FE	4
+#define UDRE	5
+#define TXC	6
+#define RXC	7
+#define UCSZ2	2
+#define TXEN	3
+#define RXEN	4
+#define UDRIE	5
+#define TXCIE	6
+#define RXCIE	7
+#define UCSZ0	1
+#define UCSZ1	2
+#define USBS	3
+
+#endif /* SIM_AVR_IO_H_ */
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+
+#include "constants.h"
+#include "data.h"
+#include "manchester.h"
+#include "hw.h"
+
+/*
+ * Robuustheid van de Manchester decoder. Berichten met instelbare
+ * verstoringen gaan als overgangen op FROM_THERM de gesimuleerde
+ * hardware in, dus door in_handler(), manch_decode() en de resync in
+ * TIMER1_COMPA_vect, en worden net als in de main loop met receive()
+ * opgehaald. Per soort verstoring komt er een curve met het
+ * percentage goed ontvangen berichten. Daarna wordt met willekeurige
+ * rommel op de lijn gezocht naar toestanden waar de decoder niet meer
+ * uit komt: na rommel en de timeout moet een goed bericht altijd
+ * weer binnenkomen.
+ *
+ * Exit code 1 als een onverstoord bericht niet goed binnenkomt of de
+ * decoder blijft hangen.
+ */
+
+int fw_main(void);
+void init(void);
+uint8_t receive(volatile in_t *in, uint8_t msg[]);
+extern volatile uint8_t mode;
+extern volatile in_t in_from_therm;
+
+#define T_HALF_NS	500000.0
+#define IDLE_NS		3000000ULL	// langer dan de 2 ms timeout
+#define MAX_EDGES	256
+
+typedef struct {
+  double jitter_us;	// uniform +/- op elke overgang
+  double duty_us;	// opgaande overgangen later, neergaande eerder
+  double drift_pct;	// bit tijd te lang (+) of te kort (-)
+  double glitch_p;	// kans op een spike per bericht
+  double glitch_us;	// breedte van de spike
+  double missing_p;	// kans op een ontbrekende overgang per bericht
+} impair_t;
+
+typedef struct {
+  uint32_t sent;
+  uint32_t good;
+  uint32_t wrong;	// bericht ontvangen maar niet wat verstuurd is
+} result_t;
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t xorshift(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static double uniform(void) {
+  return (xorshift() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint32_t random_frame(void) {
+  return (uint32_t) xorshift() & 0x7F0FFFFF;  // spare bits 0
+}
+
+static int cmp_edge(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Overgangen van een bericht, zelfde codering als sim.c, met de
+ * verstoringen erop. Tijden in ns vanaf het begin van het bericht.
+ */
+static int frame_edges(uint32_t frame, const impair_t *imp, double *edges) {
+  uint8_t bits[34], level = 0;
+  double half = T_HALF_NS * (1.0 + imp->drift_pct / 100.0), t = 0;
+  int n = 0;
+
+  frame |= (uint32_t) (__builtin_popcount(frame) & 1) << 31;
+  bits[0] = bits[33] = 1;
+  for (uint8_t i = 0; i < 32; i++) {
+    bits[i + 1] = (frame >> (31 - i)) & 1;
+  }
+  for (uint8_t i = 0; i < 34; i++) {
+    for (uint8_t h = 0; h < 2; h++) {
+      uint8_t v = h ? !bits[i] : bits[i];
+      if (v != level) {
+	double e = t + (2 * uniform() - 1) * imp->jitter_us * 1000;
+	e += (v ? 0.5 : -0.5) * imp->duty_us * 1000;
+	edges[n++] = e;
+	level = v;
+      }
+      t += half;
+    }
+  }
+  if (imp->missing_p > 0 && uniform() < imp->missing_p) {
+    int k = (int) (uniform() * n);
+    memmove(&edges[k], &edges[k + 1], (n - k - 1) * sizeof(double));
+    -- n;
+  }
+  if (imp->glitch_p > 0 && uniform() < imp->glitch_p) {
+    double g = uniform() * t;
+    edges[n++] = g;
+    edges[n++] = g + imp->glitch_us * 1000;
+  }
+  qsort(edges, n, sizeof(double), cmp_edge);
+  return n;
+}
+
+/*
+ * Zet overgangen op de lijn en laat de hardware lopen tot alles
+ * verwerkt is plus de timeout. Na elke gebeurtenis kijkt de 'main
+ * loop' of er een bericht is. Geeft het aantal ontvangen berichten
+ * terug, het laatste zonder parity bit in *got.
+ */
+static int play(const double *edges, int n, uint32_t *got) {
+  uint64_t t0 = sim_now + IDLE_NS, end, t, prev = 0;
+  uint8_t msg[FRAME_BYTES];
+  int frames = 0;
+
+  for (int k = 0; k < n; k++) {
+    t = t0 + (edges[k] > 0 ? (uint64_t) edges[k] : 0);
+    if (t <= prev) {
+      t = prev + 1;
+    }
+    hw_queue_edge(LINE_THERM, t);
+    prev = t;
+  }
+  end = (n ? prev : t0) + IDLE_NS;
+  while ((t = hw_next_event()) <= end) {
+    hw_run_until(t);
+    if (receive(&in_from_therm, msg)) {
+      *got = ((uint32_t) (msg[0] & 0x7F) << 24) | ((uint32_t) msg[1] << 16) | ((uint32_t) msg[2] << 8) | msg[3];
+      ++ frames;
+    }
+  }
+  hw_run_until(end);
+  return frames;
+}
+
+static result_t run(const impair_t *imp, uint32_t count) {
+  result_t r = { 0, 0, 0 };
+  double edges[MAX_EDGES];
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t frame = random_frame(), got = 0;
+    int n = frame_edges(frame, imp, edges);
+    int k = play(edges, n, &got);
+
+    ++ r.sent;
+    if (k == 1 && got == frame) {
+      ++ r.good;
+    } else if (k > 0 && got != frame) {
+      ++ r.wrong;
+    }
+  }
+  return r;
+}
+
+typedef struct {
+  const char *name;
+  double *field;
+  double from, to, step;
+  uint16_t t_glitch;
+} sweep_t;
+
+static uint32_t count = 1000;
+static int quiet = 0;
+
+static uint32_t curves(void) {
+  impair_t imp;
+  uint32_t failures = 0;
+  sweep_t sweeps[] = {
+    { "jitter (us)", &imp.jitter_us, 0, 200, 20, T_GLITCH },
+    { "duty distortion (us)", &imp.duty_us, 0, 400, 40, T_GLITCH },
+    { "drift (%)", &imp.drift_pct, -40, 40, 8, T_GLITCH },
+    { "glitch rate", &imp.glitch_p, 0, 1, 0.1, T_GLITCH },
+    { "  t_glitch 200", &imp.glitch_p, 0, 1, 0.1, T_GLITCH_ON },
+    { "missing edge rate", &imp.missing_p, 0, 1, 0.1, T_GLITCH },
+  };
+
+  for (size_t s = 0; s < sizeof(sweeps) / sizeof(sweeps[0]); s++) {
+    t_glitch.value = sweeps[s].t_glitch;
+    printf("%-22s", sweeps[s].name);
+    for (double v = sweeps[s].from; v <= sweeps[s].to + 1e-9; v += sweeps[s].step) {
+      printf(" %6.4g", v);
+    }
+    printf("\n%-22s", "  success %");
+    for (double v = sweeps[s].from; v <= sweeps[s].to + 1e-9; v += sweeps[s].step) {
+      memset(&imp, 0, sizeof(imp));
+      imp.glitch_us = 10;
+      *sweeps[s].field = v;
+      result_t r = run(&imp, count);
+      printf(" %6.1f", 100.0 * r.good / r.sent);
+      if (v == 0 && r.good != r.sent) {
+	++ failures;
+      }
+      if (r.wrong) {
+	printf("!");
+      }
+    }
+    printf("\n");
+  }
+  if (!quiet) {
+    printf("(! = frames with a wrong value accepted)\n");
+  }
+  return failures;
+}
+
+/*
+ * Willekeurige rommel op de lijn, dan stilte en een goed bericht.
+ * Dat bericht moet altijd binnenkomen.
+ */
+static uint32_t stuck(uint32_t trials) {
+  impair_t clean;
+  double edges[MAX_EDGES];
+  uint32_t failures = 0;
+
+  memset(&clean, 0, sizeof(clean));
+  for (uint32_t i = 0; i < trials; i++) {
+    uint32_t got = 0, frame = random_frame();
+    int n = (int) (uniform() * MAX_EDGES / 2);
+    double t = 0;
+
+    for (int k = 0; k < n; k++) {
+      // Vaak net binnen of buiten de windows, soms heel kort of lang.
+      double r = uniform();
+      t += r < 0.1 ? uniform() * 100e3 : r < 0.9 ? 300e3 + uniform() * 1200e3 : uniform() * 2500e3;
+      edges[k] = t;
+    }
+    play(edges, n, &got);
+    n = frame_edges(frame, &clean, edges);
+    if (play(edges, n, &got) != 1 || got != frame) {
+      ++ failures;
+      printf("stuck: trial %u state 0x%02x\n", i, in_from_therm.state);
+    }
+  }
+  printf("recovery after garbage, t_glitch %u: %u / %u failed\n", t_glitch.value, failures, trials);
+  return failures;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+	  "Usage: %s [-n frames] [-s seed] [-q]\n"
+	  "  -n  frames per point of a curve (%u)\n"
+	  "  -s  random seed\n"
+	  "  -q  quick run, for make check\n", name, count);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  hw_io_t io = { NULL, NULL, NULL };
+  uint32_t failures;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:q")) != -1) {
+    switch (opt) {
+    case 'n': count = atoi(optarg); break;
+    case 's': rng = strtoull(optarg, NULL, 0) | 1; break;
+    case 'q': quiet = 1; count = 200; break;
+    default: usage(argv[0]);
+    }
+  }
+
+  hw_init(&io);
+  init();
+  mode = MONITOR;
+  printf("windows: T %u..%u  2T %u..%u ticks\n", t_min.value, t_max.value, t2_min.value, t2_max.value);
+  failures = curves();
+  t_glitch.value = T_GLITCH;
+  failures += stuck(quiet ? 2000 : 20000);
+  t_glitch.value = T_GLITCH_ON;
+  failures += stuck(quiet ? 2000 : 20000);
+  printf("glitch filter: %u spikes, %u frames saved (counters wrap)\n", glitch_cntr.value, saved_cntr.value);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,451 @@
+#include <signal.h>
+#include <pthread.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+#include "constants.h"
+#include "data.h"
+#include "serial.h"
+#include "hw.h"
+
+/*
+ * De ATtiny4313 zoals de firmware hem ziet. Zie hw.h.
+ */
+
+volatile uint8_t PORTB, DDRB, PINB;
+volatile uint8_t PORTD, DDRD, PIND;
+volatile uint8_t MCUCR, GIMSK, MCUSR, WDTCR;
+volatile uint8_t TCCR0A, TCCR0B, OCR0A, OCR0B, TIMSK, TIFR;
+volatile uint8_t TCCR1A, TCCR1B;
+volatile uint16_t OCR1A;
+volatile uint8_t UBRRH, UBRRL, UCSRB, UCSRC;
+
+extern volatile cb_t cb_in;
+extern volatile cb_t cb_out;
+extern volatile in_t in_from_therm;
+extern volatile in_t in_from_boiler;
+
+volatile uint64_t sim_now;
+hw_stats_t hw_stats;
+uint32_t hw_rx_dor_every;
+
+#define NEVER		UINT64_MAX
+#define BYTE_NS		(10 * NS_PER_S / BAUD)	// 8N1
+#define OUT_MASK	((1 << TO_BOILER) | (1 << TO_THERM))
+
+// Gelezen waarde van TCNT1 heeft bit 16 gezet, na schrijven niet meer.
+#define TCNT1_READ	0x10000UL
+// UDR zonder data om te verzenden, bit 9 = ontvangen karakter.
+#define UDR_EMPTY	0x100
+#define UDR_RX		0x200
+
+static hw_io_t io;
+
+#define EDGE_Q		1024	// macht van twee
+typedef struct {
+  uint64_t t[EDGE_Q];
+  uint16_t start;
+  uint16_t count;
+  uint64_t last;
+} edge_q_t;
+
+static edge_q_t edges[2];
+
+static volatile uint32_t tcnt1_reg = TCNT1_READ;
+static uint64_t t1_base;
+static uint32_t t1_wraps;
+static uint32_t t1_ovfs;
+
+static volatile uint8_t ucsra_reg = (1 << UDRE);
+static volatile uint16_t udr_reg = UDR_EMPTY;
+static volatile uint16_t udr_tx = UDR_EMPTY;	// UDR voor zenden tijdens USART_RX_vect
+static uint64_t tx_done = NEVER;
+static uint8_t tx_shift;
+static uint64_t rx_next;
+static uint8_t rx_have, rx_c;
+static uint32_t rx_dor_cnt;
+
+static volatile uint8_t wdt_on;
+static volatile uint64_t wdt_period, wdt_deadline;
+
+static uint8_t out_level;
+
+// ============================== registers ==============================
+
+static uint64_t t1_count(void) {
+  return (uint64_t) ((unsigned __int128) (sim_now - t1_base) * F_CPU / (8 * NS_PER_S));
+}
+
+volatile uint32_t *sim_tcnt1(void) {
+  tcnt1_reg = TCNT1_READ | (t1_count() & 0xFFFF);
+  return &tcnt1_reg;
+}
+
+volatile uint8_t *sim_ucsra(void) {
+  // UDRE hoort bij zenden, ook als USART_RX_vect UCSRA leest.
+  if (((udr_reg & UDR_RX) ? udr_tx : udr_reg) < UDR_EMPTY) {
+    ucsra_reg &= ~(1 << UDRE);
+  } else {
+    ucsra_reg |= (1 << UDRE);
+  }
+  return &ucsra_reg;
+}
+
+volatile uint16_t *sim_udr(void) {
+  return &udr_reg;
+}
+
+// ============================== interrupts ==============================
+
+/*
+ * De hardware draait in de handler van SIGALRM. Interrupts uit is
+ * dus gewoon dat signaal blokkeren.
+ */
+static int irq_block(int how) {
+  sigset_t s, old;
+
+  sigemptyset(&s);
+  sigaddset(&s, SIGALRM);
+  pthread_sigmask(how, &s, &old);
+  return !sigismember(&old, SIGALRM);
+}
+
+void sim_cli(void) {
+  irq_block(SIG_BLOCK);
+}
+
+void sim_sei(void) {
+  irq_block(SIG_UNBLOCK);
+}
+
+int sim_irq_save(void) {
+  return irq_block(SIG_BLOCK);
+}
+
+int sim_irq_restore(int state) {
+  if (state) {
+    irq_block(SIG_UNBLOCK);
+  }
+  return 0;
+}
+
+// ============================== watchdog / delay ==============================
+
+void wdt_enable(uint8_t timeout) {
+  wdt_period = 16000000ULL << timeout;  // 2048 cycli van 128 kHz
+  wdt_deadline = sim_now + wdt_period;
+  wdt_on = 1;
+}
+
+void wdt_disable(void) {
+  wdt_on = 0;
+}
+
+void wdt_reset(void) {
+  wdt_deadline = sim_now + wdt_period;
+}
+
+void _delay_us(double us) {
+  uint64_t until = sim_now + (uint64_t) (us * 1000);
+
+  while (sim_now < until) {}
+}
+
+void _delay_ms(double ms) {
+  _delay_us(ms * 1000);
+}
+
+// ============================== hardware ==============================
+
+/*
+ * Na elke ISR: is TCNT1 beschreven en zijn de uitgangen veranderd?
+ */
+static void after_isr(void) {
+  uint8_t level, changed;
+
+  if (!(tcnt1_reg & TCNT1_READ)) {
+    t1_base = sim_now - TICK1_NS(tcnt1_reg & 0xFFFF);
+    t1_wraps = 0;
+    t1_ovfs = 0;
+    tcnt1_reg = TCNT1_READ;
+  }
+  level = PORTD & OUT_MASK;
+  changed = level ^ out_level;
+  out_level = level;
+  if (io.on_output) {
+    if (changed & (1 << TO_BOILER)) {
+      io.on_output(LINE_BOILER, !!(level & (1 << TO_BOILER)), sim_now);
+    }
+    if (changed & (1 << TO_THERM)) {
+      io.on_output(LINE_THERM, !!(level & (1 << TO_THERM)), sim_now);
+    }
+  }
+}
+
+/*
+ * UDR naar schuifregister en, zolang UDR leeg is en UDRIE aan staat,
+ * de UDRE interrupt.
+ */
+static void uart_step(void) {
+  for (uint8_t n = 0; n < 4; n++) {
+    if (tx_done == NEVER && udr_reg < UDR_EMPTY) {
+      tx_shift = udr_reg;
+      udr_reg = UDR_EMPTY;
+      tx_done = sim_now + BYTE_NS;
+    }
+    if (udr_reg < UDR_EMPTY || !(UCSRB & (1 << UDRIE))) {
+      break;
+    }
+    USART_UDRE_vect();
+    after_isr();
+  }
+}
+
+static void input_edge(uint8_t line) {
+  volatile in_t *in = (line == LINE_THERM) ? &in_from_therm : &in_from_boiler;
+  uint8_t was_done = (in->state == DONE);
+
+  PIND ^= (line == LINE_THERM) ? (1 << FROM_THERM) : (1 << FROM_BOILER);
+  ++ hw_stats.edges[line];
+  if (line == LINE_THERM) {
+    if (GIMSK & (1 << INT1)) {
+      INT1_vect();
+      after_isr();
+    }
+  } else {
+    if (GIMSK & (1 << INT0)) {
+      INT0_vect();
+      after_isr();
+    }
+  }
+  if (in->state == DONE && !was_done) {
+    ++ hw_stats.decoded[line];
+  } else if (was_done && in->state != DONE) {
+    ++ hw_stats.lost[line];
+  }
+}
+
+static uint64_t t0_next(void) {
+  uint64_t period = (uint64_t) (OCR0A + 1) * 64 * NS_PER_S / F_CPU;
+
+  if (!(TIMSK & ((1 << OCIE0A) | (1 << OCIE0B)))) {
+    return NEVER;
+  }
+  return (sim_now / period + 1) * period;
+}
+
+static void timer0(void) {
+  if (TIMSK & (1 << OCIE0A)) {
+    TIMER0_COMPA_vect();
+    after_isr();
+    if (!(TIMSK & (1 << OCIE0A))) {
+      ++ hw_stats.encoded[LINE_BOILER];
+    }
+  }
+  if (TIMSK & (1 << OCIE0B)) {
+    TIMER0_COMPB_vect();
+    after_isr();
+    if (!(TIMSK & (1 << OCIE0B))) {
+      ++ hw_stats.encoded[LINE_THERM];
+    }
+  }
+}
+
+/*
+ * Compare match van timer 1: OCR1A ticks na de laatste reset van
+ * TCNT1 en daarna elke keer als de teller rond is.
+ */
+static uint64_t t1_next(void) {
+  return t1_base + TICK1_NS(OCR1A + 65536ULL * t1_wraps);
+}
+
+static void timer1(void) {
+  uint64_t base = t1_base;
+
+  if (TIMSK & (1 << OCIE1A)) {
+    TIMER1_COMPA_vect();
+    after_isr();
+  }
+  if (t1_base == base) {
+    ++ t1_wraps;
+  }
+}
+
+/*
+ * Overflow van timer 1: elke 0x10000 ticks na de laatste reset. Zonder
+ * TOIE1 blijft TOV1 in TIFR staan, net als op de chip.
+ */
+static uint64_t t1_ovf_next(void) {
+  return t1_base + TICK1_NS(65536ULL * (t1_ovfs + 1));
+}
+
+static void timer1_ovf(void) {
+  ++ t1_ovfs;
+  if (TIMSK & (1 << TOIE1)) {
+    TIFR &= ~(1 << TOV1);
+#ifdef BENCH
+    TIMER1_OVF_vect();		// alleen de BENCH firmware zet TOIE1
+#endif
+    after_isr();
+  } else {
+    TIFR |= (1 << TOV1);
+  }
+}
+
+static void uart_rx(void) {
+  uint16_t saved = udr_reg;
+  uint8_t count = cb_in.count;
+
+  udr_tx = saved;
+  udr_reg = UDR_RX | rx_c;
+  if (hw_rx_dor_every && ++ rx_dor_cnt >= hw_rx_dor_every) {
+    rx_dor_cnt = 0;
+    ucsra_reg |= (1 << DOR);	// vorige byte niet op tijd gelezen
+    ++ hw_stats.rx_dors;
+  }
+  if (UCSRB & (1 << RXCIE)) {
+    USART_RX_vect();
+    after_isr();
+    if (count == BUF_SIZE) {
+      ++ hw_stats.rx_overruns;
+    }
+  }
+  ucsra_reg &= ~(1 << DOR);
+  udr_reg = saved;
+  rx_have = 0;
+  rx_next = sim_now + BYTE_NS;
+  ++ hw_stats.rx_bytes;
+}
+
+static void uart_tx_done(void) {
+  tx_done = NEVER;
+  if (io.uart_tx && io.uart_tx(tx_shift)) {
+    ++ hw_stats.tx_bytes;
+  } else {
+    ++ hw_stats.tx_drops;
+  }
+}
+
+static void wdt_fire(void) {
+  wdt_on = 0;
+  ++ hw_stats.wdt_fires;
+  WDT_OVERFLOW_vect();
+  after_isr();
+}
+
+enum { EV_NONE, EV_TX, EV_BOILER, EV_THERM, EV_T0, EV_T1, EV_T1_OVF, EV_RX, EV_WDT };
+
+static uint8_t next_event(uint64_t *when) {
+  uint8_t ev = EV_NONE;
+  uint64_t t = NEVER, c;
+
+#define CANDIDATE(value, id) c = (value); if (c < t) { t = c; ev = (id); }
+  CANDIDATE(tx_done, EV_TX);
+  CANDIDATE(edges[LINE_BOILER].count ? edges[LINE_BOILER].t[edges[LINE_BOILER].start] : NEVER, EV_BOILER);
+  CANDIDATE(edges[LINE_THERM].count ? edges[LINE_THERM].t[edges[LINE_THERM].start] : NEVER, EV_THERM);
+  CANDIDATE(t0_next(), EV_T0);
+  CANDIDATE(t1_next(), EV_T1);
+  CANDIDATE(t1_ovf_next(), EV_T1_OVF);
+  CANDIDATE(rx_have ? (rx_next > sim_now ? rx_next : sim_now) : NEVER, EV_RX);
+  CANDIDATE(wdt_on ? wdt_deadline : NEVER, EV_WDT);
+#undef CANDIDATE
+  *when = t;
+  return ev;
+}
+
+uint64_t hw_next_event(void) {
+  uint64_t t;
+
+  next_event(&t);
+  return t;
+}
+
+void hw_run_until(uint64_t t) {
+  uint64_t when, start = sim_now;
+  uint8_t ev;
+
+  if (!rx_have && io.uart_rx) {
+    rx_have = io.uart_rx(&rx_c);
+  }
+  for (;;) {
+    uart_step();
+    ev = next_event(&when);
+    if (ev == EV_NONE || when > t) {
+      break;
+    }
+    if (when > sim_now) {
+      sim_now = when;
+    }
+    switch (ev) {
+    case EV_TX:
+      uart_tx_done();
+      break;
+    case EV_BOILER:
+    case EV_THERM: {
+      edge_q_t *q = &edges[ev == EV_THERM ? LINE_THERM : LINE_BOILER];
+      q->start = (q->start + 1) & (EDGE_Q - 1);
+      -- q->count;
+      input_edge(ev == EV_THERM ? LINE_THERM : LINE_BOILER);
+      break;
+    }
+    case EV_T0:
+      timer0();
+      break;
+    case EV_T1:
+      timer1();
+      break;
+    case EV_T1_OVF:
+      timer1_ovf();
+      break;
+    case EV_RX:
+      uart_rx();
+      if (io.uart_rx) {
+	rx_have = io.uart_rx(&rx_c);
+      }
+      break;
+    case EV_WDT:
+      wdt_fire();
+      break;
+    }
+  }
+  if (t > sim_now) {
+    sim_now = t;
+  }
+  if (cb_out.count == BUF_SIZE) {
+    hw_stats.cb_out_full_ns += sim_now - start;
+  }
+}
+
+/*
+ * Zet een overgang op FROM_BOILER of FROM_THERM klaar. Tijden moeten
+ * oplopen. Geeft 0 terug als de wachtrij vol is.
+ */
+uint8_t hw_queue_edge(uint8_t line, uint64_t t) {
+  edge_q_t *q = &edges[line];
+
+  if (q->count == EDGE_Q) {
+    return 0;
+  }
+  q->t[(q->start + q->count) & (EDGE_Q - 1)] = t;
+  ++ q->count;
+  q->last = t;
+  return 1;
+}
+
+uint64_t hw_last_edge(uint8_t line) {
+  return edges[line].last;
+}
+
+void hw_init(const hw_io_t *init) {
+  io = *init;
+  PIND = 0;			// Ingangen in rust laag, uitgangen hoog.
+  out_level = OUT_MASK;
+  t1_base = sim_now;
+  t1_wraps = 0;
+  t1_ovfs = 0;
+  sim_cli();			// Net als na een reset
+}
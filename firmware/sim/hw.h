@@ -0,0 +1,56 @@
+#ifndef SIM_HW_H_
+#define SIM_HW_H_
+
+/*
+ * Gesimuleerde hardware rond de firmware: timers, USART, INT0 / INT1,
+ * watchdog. Alle tijden zijn in ns gesimuleerde tijd. hw_run_until()
+ * verwerkt alle gebeurtenissen tot een tijdstip en roept daarbij de
+ * ISR's van de firmware aan, dus alleen aanroepen als de interrupts
+ * van de firmware aan staan.
+ */
+
+#include <stdint.h>
+
+#define LINE_BOILER	0	// FROM_BOILER / TO_BOILER, INT0
+#define LINE_THERM	1	// FROM_THERM / TO_THERM, INT1
+
+#define NS_PER_S	1000000000ULL
+#define TICK1_NS(t)	((uint64_t) (t) * 8 * NS_PER_S / F_CPU)	// timer 1, prescaler 8
+
+typedef struct {
+  uint64_t edges[2];		// ingangen
+  uint64_t decoded[2];		// berichten die in_handler compleet had
+  uint64_t lost[2];		// compleet maar niet door main loop opgehaald
+  uint64_t encoded[2];		// berichten die manch_encode verzonden heeft
+  uint64_t rx_bytes;		// host -> gw
+  uint64_t rx_overruns;		// bytes weggegooid omdat cb_in vol zat
+  uint64_t rx_dors;		// bytes met een gesimuleerde DOR
+  uint64_t tx_bytes;		// gw -> host
+  uint64_t tx_drops;		// host las niet snel genoeg
+  uint64_t cb_out_full_ns;	// tijd dat cb_out vol zat
+  uint64_t wdt_fires;
+} hw_stats_t;
+
+extern volatile uint64_t sim_now;
+extern hw_stats_t hw_stats;
+extern uint32_t hw_rx_dor_every;	// elke zoveelste byte van de host een DOR, 0 = nooit
+
+/*
+ * Koppeling naar de buitenwereld. uart_tx geeft 0 terug als de host
+ * het karakter niet aan kan nemen, uart_rx geeft 1 terug als er een
+ * karakter van de host is. on_output wordt aangeroepen bij elke
+ * overgang op TO_BOILER / TO_THERM.
+ */
+typedef struct {
+  uint8_t (*uart_tx)(uint8_t c);
+  uint8_t (*uart_rx)(uint8_t *c);
+  void (*on_output)(uint8_t line, uint8_t level, uint64_t t);
+} hw_io_t;
+
+void hw_init(const hw_io_t *io);
+void hw_run_until(uint64_t t);
+uint8_t hw_queue_edge(uint8_t line, uint64_t t);
+uint64_t hw_last_edge(uint8_t line);
+uint64_t hw_next_event(void);
+
+#endif /* SIM_HW_H_ */
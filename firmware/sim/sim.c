@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+
+#include "constants.h"
+#include "data.h"
+#include "protocol.h"
+#include "serial.h"
+#include "manchester.h"
+#include "hw.h"
+
+/*
+ * Gateway simulator. De echte firmware (main.c, manchester.c en
+ * serial.c) draait tegen de nagebootste registers uit hw.c en de
+ * USART is een pseudo-terminal waar othost.py op aangesloten kan
+ * worden. Een thermostaat stuurt met een instelbare snelheid
+ * verzoeken en een ketel beantwoordt alles wat hij op TO_BOILER
+ * ontvangt, dus in MONITOR en INTERCEPT mode loopt alles zoals met
+ * echte hardware. De gesimuleerde tijd kan sneller lopen dan de echte
+ * tijd om de host en de buffers zwaar te belasten.
+ */
+
+int fw_main(void);
+extern volatile uint8_t mode;
+extern volatile cb_t cb_in;
+extern volatile cb_t cb_out;
+
+#define T_HALF_NS	500000ULL	// halve bit tijd OpenTherm
+#define GAP_NS		3000000ULL	// minimaal tussen twee berichten, > timeout
+#define TIMEOUT_NS	TICK1_NS(T_1MS * 2)
+
+static double rate = 1.0;		// verzoeken thermostaat per sim seconde
+static double scale = 1.0;		// sim seconden per echte seconde
+static uint64_t reply_ns = 20000000ULL;	// antwoordtijd ketel
+static uint64_t jitter_ns = 0;
+static uint64_t tick_ns = 20000;	// elke 20 us de hardware bijwerken
+static double report_s = 1.0;
+static double duration_s = 0;
+
+static int pty_master = -1;
+static uint8_t rx_buf[64];
+static int rx_len, rx_pos;
+
+static uint64_t v_anchor, w_anchor, max_step;
+static uint64_t next_request;
+static uint64_t requests, replies, boiler_replies;
+static uint32_t request_nr;
+
+static volatile in_t dec[2];		// decoders op TO_BOILER / TO_THERM
+static uint64_t dec_last[2];
+
+// ============================== host ==============================
+
+static uint8_t pty_tx(uint8_t c) {
+  return write(pty_master, &c, 1) == 1;
+}
+
+static uint8_t pty_rx(uint8_t *c) {
+  if (rx_pos == rx_len) {
+    rx_len = read(pty_master, rx_buf, sizeof(rx_buf));
+    rx_pos = 0;
+    if (rx_len <= 0) {
+      rx_len = 0;
+      return 0;
+    }
+  }
+  *c = rx_buf[rx_pos++];
+  return 1;
+}
+
+// ============================== OpenTherm lijnen ==============================
+
+static uint64_t jitter(void) {
+  return jitter_ns ? (uint64_t) random() % (2 * jitter_ns) : 0;
+}
+
+/*
+ * Zet een volledig bericht, met start bit, parity en stop bit, als
+ * overgangen klaar op een ingang van de gateway. De lijn is in rust
+ * laag. Geeft het tijdstip van de laatste overgang terug.
+ */
+static uint64_t queue_frame(uint8_t line, uint32_t frame, uint64_t t) {
+  uint8_t level = 0, bits[34];
+
+  frame &= 0x7FFFFFFF;
+  frame |= (uint32_t) (__builtin_popcount(frame) & 1) << 31;
+  bits[0] = bits[33] = 1;
+  for (uint8_t i = 0; i < 32; i++) {
+    bits[i + 1] = (frame >> (31 - i)) & 1;
+  }
+  for (uint8_t i = 0; i < 34; i++) {
+    for (uint8_t half = 0; half < 2; half++) {
+      uint8_t h = half ? !bits[i] : bits[i];
+      if (h != level) {
+	hw_queue_edge(line, t - jitter_ns + jitter());
+	level = h;
+      }
+      t += T_HALF_NS;
+    }
+  }
+  return hw_last_edge(line);
+}
+
+static uint64_t line_free(uint8_t line, uint64_t t) {
+  uint64_t free = hw_last_edge(line) + GAP_NS;
+
+  if (free < sim_now) {
+    free = sim_now;
+  }
+  return t > free ? t : free;
+}
+
+/*
+ * De thermostaat: een vaste lijst verzoeken, net als een echte
+ * thermostaat die rond gaat langs de DataIDs.
+ */
+static const uint32_t therm_requests[] = {
+  0x00000300,	// READ Status, CH en DHW enable
+  0x10012D00,	// WRITE TSet 45.0
+  0x00190000,	// READ Tboiler
+  0x00110000,	// READ Rel.-mod-level
+  0x00120000,	// READ CH-pressure
+  0x001C0000,	// READ Tret
+  0x001A0000,	// READ Tdhw
+  0x001B0000,	// READ Toutside
+  0x00740000,	// READ Burner starts
+  0x00780000,	// READ Burner operation hours
+};
+
+static void therm_run(uint64_t until) {
+  while (rate > 0 && next_request <= until) {
+    uint32_t frame = therm_requests[request_nr++ % (sizeof(therm_requests) / sizeof(therm_requests[0]))];
+    queue_frame(LINE_THERM, frame, line_free(LINE_THERM, next_request));
+    ++ requests;
+    next_request += (uint64_t) (NS_PER_S / rate);
+  }
+}
+
+/*
+ * De ketel beantwoordt elk bericht MASTER -> SLAVE dat hij ontvangt.
+ */
+static uint32_t boiler_reply(uint32_t frame) {
+  uint8_t type = (frame >> 24) & MSGID_MSK;
+  uint8_t id = (frame >> 16) & 0xFF;
+  uint16_t value = frame & 0xFFFF;
+
+  switch (type) {
+  case READ_DATA:
+    type = READ_ACL;
+    switch (id) {
+    case 0:  value = 0x030A; break;				// CH, DHW, flame
+    case 17: value = 40 << 8; break;
+    case 18: value = (1 << 8) | 0x80; break;			// 1.5 bar
+    case 25: value = (55 << 8) + (sim_now / NS_PER_S) % 256; break;
+    case 26: value = 50 << 8; break;
+    case 27: value = 8 << 8; break;
+    case 28: value = 40 << 8; break;
+    case 116: case 120: value = (sim_now / (60 * NS_PER_S)) & 0xFFFF; break;
+    default:
+      type = UNKNOWN_DATAID;
+    }
+    break;
+  case WRITE_DATA:
+    type = WRITE_ACK;
+    break;
+  default:
+    type = DATA_INVALID;
+  }
+  return ((uint32_t) (type | (1 << MSTR_TO_SLV_BIT)) << 24) | ((uint32_t) id << 16) | value;
+}
+
+/*
+ * Overgang op een uitgang van de gateway. Wordt met de Manchester
+ * decoder van de firmware zelf gelezen.
+ */
+static void on_output(uint8_t line, uint8_t level, uint64_t t) {
+  volatile in_t *in = &dec[line];
+  uint64_t dt = t - dec_last[line];
+  uint32_t frame;
+
+  dec_last[line] = t;
+  if (dt > TIMEOUT_NS && in->state != DONE) {
+    in->state = WAITING;
+  }
+  manch_decode(in, (uint16_t) (dt > TIMEOUT_NS ? 0xFFFF : dt * F_CPU / (8 * NS_PER_S)));
+  if (in->state != DONE) {
+    return;
+  }
+  in->state = WAITING;
+  if (in->parity) {
+    return;
+  }
+  frame = ((uint32_t) (in->msg[0] & 0x7F) << 24) | ((uint32_t) in->msg[1] << 16) |
+    ((uint32_t) in->msg[2] << 8) | in->msg[3];
+  if (line == LINE_BOILER && !(frame & (1UL << (24 + MSTR_TO_SLV_BIT)))) {
+    queue_frame(LINE_BOILER, boiler_reply(frame), line_free(LINE_BOILER, t + reply_ns));
+    ++ boiler_replies;
+  } else if (line == LINE_THERM && (frame & (1UL << (24 + MSTR_TO_SLV_BIT)))) {
+    ++ replies;
+  }
+}
+
+// ============================== tijd ==============================
+
+static uint64_t wall_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+/*
+ * Elke tick: gesimuleerde tijd bijwerken en de hardware laten
+ * lopen. Als de simulatie achter raakt wordt niet ingehaald maar loopt
+ * de gesimuleerde tijd langzamer.
+ */
+static void tick(int sig) {
+  uint64_t wall = wall_ns();
+  uint64_t target = v_anchor + (uint64_t) ((wall - w_anchor) * scale);
+
+  (void) sig;
+  if (target > sim_now + max_step) {
+    target = sim_now + max_step;
+    v_anchor = target;
+    w_anchor = wall;
+  }
+  therm_run(target);
+  hw_run_until(target);
+}
+
+// ============================== rapportage ==============================
+
+static void report(FILE *f) {
+  fprintf(f, "t=%.1fs mode=%u req=%llu gw rx therm/boiler=%llu/%llu lost=%llu/%llu "
+	  "to host=%llu frames drop=%llu from host=%llu B overrun=%llu dor=%llu cb_in=%u cb_out=%u "
+	  "cb_out full=%.1f%% boiler replies=%llu therm replies=%llu wdt=%llu\n",
+	  sim_now / 1e9, mode, (unsigned long long) requests,
+	  (unsigned long long) hw_stats.decoded[LINE_THERM], (unsigned long long) hw_stats.decoded[LINE_BOILER],
+	  (unsigned long long) hw_stats.lost[LINE_THERM], (unsigned long long) hw_stats.lost[LINE_BOILER],
+	  (unsigned long long) hw_stats.tx_bytes / FRAME_BYTES, (unsigned long long) hw_stats.tx_drops,
+	  (unsigned long long) hw_stats.rx_bytes, (unsigned long long) hw_stats.rx_overruns,
+	  (unsigned long long) hw_stats.rx_dors,
+	  cb_in.count, cb_out.count,
+	  sim_now ? 100.0 * hw_stats.cb_out_full_ns / sim_now : 0.0,
+	  (unsigned long long) boiler_replies, (unsigned long long) replies,
+	  (unsigned long long) hw_stats.wdt_fires);
+  fflush(f);
+}
+
+static void *reporter(void *arg) {
+  sigset_t stop;
+  struct timespec wait = { (time_t) report_s, (long) ((report_s - (time_t) report_s) * 1e9) };
+
+  (void) arg;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  for (;;) {
+    int sig = sigtimedwait(&stop, NULL, &wait);
+    if (sig > 0 || (duration_s > 0 && sim_now >= duration_s * NS_PER_S)) {
+      report(stdout);
+      _exit(0);
+    }
+    report(stderr);
+  }
+  return NULL;
+}
+
+// ============================== main ==============================
+
+static void usage(const char *name) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "  -r rate     thermostat requests per simulated second (%.1f)\n"
+	  "  -s scale    simulated seconds per real second (%.1f)\n"
+	  "  -d ms       boiler reply delay (%llu)\n"
+	  "  -j us       jitter on input edges (0)\n"
+	  "  -t us       hardware tick in real time (%llu)\n"
+	  "  -o n        every n-th byte from the host arrives with DOR (0, off)\n"
+	  "  -l path     symlink to the pseudo-terminal\n"
+	  "  -i s        report interval (%.1f)\n"
+	  "  -T s        stop after this many simulated seconds\n",
+	  name, rate, scale, (unsigned long long) (reply_ns / 1000000),
+	  (unsigned long long) (tick_ns / 1000), report_s);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, slave;
+  char name[128];
+  const char *link = NULL;
+  sigset_t block;
+  struct sigaction sa;
+  struct itimerval it;
+  struct termios tio;
+  pthread_t rep;
+  hw_io_t io = { pty_tx, pty_rx, on_output };
+
+  while ((opt = getopt(argc, argv, "r:s:d:j:t:o:l:i:T:h")) != -1) {
+    switch (opt) {
+    case 'r': rate = atof(optarg); break;
+    case 's': scale = atof(optarg); break;
+    case 'd': reply_ns = (uint64_t) (atof(optarg) * 1e6); break;
+    case 'j': jitter_ns = (uint64_t) (atof(optarg) * 1e3); break;
+    case 't': tick_ns = (uint64_t) (atof(optarg) * 1e3); break;
+    case 'o': hw_rx_dor_every = (uint32_t) atol(optarg); break;
+    case 'l': link = optarg; break;
+    case 'i': report_s = atof(optarg); break;
+    case 'T': duration_s = atof(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (scale <= 0 || tick_ns == 0 || report_s <= 0) {
+    usage(argv[0]);
+  }
+
+  if (openpty(&pty_master, &slave, name, NULL, NULL) < 0) {
+    perror("openpty");
+    return 1;
+  }
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  fcntl(pty_master, F_SETFL, fcntl(pty_master, F_GETFL) | O_NONBLOCK);
+  if (link) {
+    unlink(link);
+    if (symlink(name, link) < 0) {
+      perror("symlink");
+      return 1;
+    }
+  }
+  printf("%s\n", name);
+  fflush(stdout);
+
+  // De reporter vangt SIGINT / SIGTERM af, alleen de firmware krijgt SIGALRM.
+  hw_init(&io);
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &block, NULL);
+  pthread_create(&rep, NULL, reporter, NULL);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = tick;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGALRM, &sa, NULL);
+
+  max_step = (uint64_t) (2 * tick_ns * scale);
+  w_anchor = wall_ns();
+  v_anchor = sim_now;
+  next_request = NS_PER_S / 2;
+  it.it_interval.tv_sec = it.it_value.tv_sec = tick_ns / NS_PER_S;
+  it.it_interval.tv_usec = it.it_value.tv_usec = (tick_ns % NS_PER_S) / 1000;
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  fw_main();  // sei() in de firmware zet de hardware aan
+  return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef SIM_UTIL_ATOMIC_H_
+#define SIM_UTIL_ATOMIC_H_
+
+/*
+ * Zelfde gebruik als avr-libc: interrupts uit voor de duur van het
+ * blok en daarna de oude toestand terug (RESTORESTATE) of aan
+ * (FORCEON).
+ */
+
+int sim_irq_save(void);
+int sim_irq_restore(int state);
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+
+#define ATOMIC_BLOCK(type) \
+  for (int __sim_state = sim_irq_save() | ((type) << 1), __todo = 1; \
+       __todo; __todo = sim_irq_restore(__sim_state))
+
+#endif /* SIM_UTIL_ATOMIC_H_ */
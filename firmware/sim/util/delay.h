@@ -0,0 +1,8 @@
+#ifndef SIM_UTIL_DELAY_H_
+#define SIM_UTIL_DELAY_H_
+
+// Wacht in gesimuleerde tijd.
+void _delay_ms(double ms);
+void _delay_us(double us);
+
+#endif /* SIM_UTIL_DELAY_H_ */
@@ -0,0 +1,14 @@
+#ifndef SIM_UTIL_SETBAUD_H_
+#define SIM_UTIL_SETBAUD_H_
+
+/*
+ * De simulator rekent zelf met BAUD, de register waarden doen er
+ * niet toe.
+ */
+
+#define UBRR_VALUE	(((F_CPU) + 8UL * (BAUD)) / (16UL * (BAUD)) - 1UL)
+#define UBRRH_VALUE	(UBRR_VALUE >> 8)
+#define UBRRL_VALUE	(UBRR_VALUE & 0xff)
+#define USE_2X		0
+
+#endif /* SIM_UTIL_SETBAUD_H_ */
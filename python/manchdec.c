@@ -0,0 +1,147 @@
+/*
+ * Offline Manchester decoder for raw edge captures.
+ *
+ * This is only the glue between manchdec.py and manch_decode() in
+ * firmware/manchester.c, which is linked in as is (see Makefile), so
+ * frames decoded here can be compared one to one with what the
+ * gateway decoded. The input is an array of Timer 1 values
+ * (prescaler 8, ca 0.72 us per tick), one per edge, as in_handler()
+ * would have read them from TCNT1.
+ *
+ * The decode windows are the globals t_min .. t_glitch of
+ * manchester.c, so only one decode may run at a time.
+ */
+
+#include <stddef.h>
+#include <avr/io.h>
+
+#include "constants.h"
+#include "data.h"
+#include "manchester.h"
+
+// Registers die manchester.c aanraakt, voor de LEDs en manch_encode().
+volatile uint8_t PORTB, PORTD, TIMSK;
+
+typedef struct {
+  uint16_t t_min;
+  uint16_t t_max;
+  uint16_t t2_min;
+  uint16_t t2_max;
+  uint16_t t_timeout;  // OCR1A, TIMER1_COMPA_vect reset de ingang
+  uint16_t t_glitch;   // 0 = geen spike filter
+} md_windows_t;
+
+typedef struct {
+  uint64_t edges;
+  uint64_t frames;
+  uint64_t parity_errors;
+  uint64_t sync_errors;
+  uint64_t errors;
+  uint64_t timeouts;
+  uint64_t glitches;
+  uint64_t saved;
+} md_stats_t;
+
+void md_reset(in_t *in) {
+  in->state = WAITING;
+  in->hold = HOLD_NONE;
+}
+
+/*
+ * Een overgang naar manch_decode(). De firmware telt alleen spikes en
+ * geredde berichten, de fouten worden hier afgeleid uit de toestand
+ * voor en na: een interval buiten de windows is een SYNC_ERROR, een
+ * interval in het verkeerde window een ERROR.
+ */
+static void md_edge(in_t *in, uint16_t tc1_value, md_stats_t *st) {
+  uint8_t state = in->state;
+  uint8_t hold = in->hold;
+  uint16_t value = (hold == HOLD_MERGE) ? (uint16_t) (tc1_value + in->carry) : tc1_value;
+  uint16_t glitches = glitch_cntr.value;
+  uint16_t saved = saved_cntr.value;
+
+  manch_decode(in, tc1_value);
+
+  if (glitch_cntr.value != glitches) {
+    ++ st->glitches;
+  } else if (state != WAITING && state != DONE) {
+    if (hold == HOLD_PART) {
+      ++ st->sync_errors;  // Geen spike, het korte interval was fout.
+    } else if (in->state == WAITING) {
+      if (value < t_min.value || (value > t_max.value && value < t2_min.value) ||
+	  value > t2_max.value) {
+	++ st->sync_errors;
+      } else {
+	++ st->errors;
+      }
+    }
+  }
+  if (saved_cntr.value != saved) {
+    ++ st->saved;
+  }
+}
+
+/*
+ * Decodeer een batch van n edge intervallen. De toestand van de
+ * decoder zit in 'in', zodat een capture in meerdere batches kan
+ * worden verwerkt. Gevonden frames worden, net als in in_handler(),
+ * met parity bit in 'frames' gezet (msb eerst) met in 'pos' de index
+ * van de edge (plus 'base') waarop het frame compleet was. Er worden
+ * maximaal max_frames frames weggeschreven; frames en pos mogen NULL
+ * zijn als alleen de statistieken nodig zijn. Geeft het aantal
+ * gevonden frames terug.
+ */
+size_t md_decode(in_t *in, const md_windows_t *w,
+		 const uint16_t *ticks, size_t n,
+		 uint32_t *frames, uint64_t *pos, size_t max_frames,
+		 md_stats_t *st, uint64_t base) {
+  size_t found = 0;
+
+  t_min.value = w->t_min;
+  t_max.value = w->t_max;
+  t2_min.value = w->t2_min;
+  t2_max.value = w->t2_max;
+  t_glitch.value = w->t_glitch;
+
+  for (size_t k = 0; k < n; k++) {
+    uint16_t t = ticks[k];
+
+    // TIMER1_COMPA_vect: te lang geen overgang, begin opnieuw.
+    if (t >= w->t_timeout && in->state != WAITING) {
+      ++ st->timeouts;
+      in->state = WAITING;
+    }
+    md_edge(in, t, st);
+    if (in->state != DONE) {
+      continue;
+    }
+    // receive(): bericht ophalen en ingang weer vrijgeven.
+    if (in->parity) {
+      ++ st->parity_errors;
+    } else {
+      if (frames && found < max_frames) {
+	frames[found] = ((uint32_t) in->msg[0] << 24) | ((uint32_t) in->msg[1] << 16) |
+	  ((uint32_t) in->msg[2] << 8) | in->msg[3];
+	pos[found] = base + k;
+      }
+      ++ found;
+      ++ st->frames;
+    }
+    in->state = WAITING;
+  }
+  st->edges += n;
+  return found;
+}
+
+/*
+ * Decodeer dezelfde capture met m verschillende window instellingen,
+ * bijvoorbeeld om de beste SET_T_* waarden voor een installatie te
+ * vinden. Voor elke instelling komen de statistieken in stats[j].
+ */
+void md_sweep(const uint16_t *ticks, size_t n,
+	      const md_windows_t *w, size_t m, md_stats_t *stats) {
+  for (size_t j = 0; j < m; j++) {
+    in_t in = { {0}, WAITING };
+    md_decode(&in, &w[j], ticks, n, NULL, NULL, 0, &stats[j], 0);
+  }
+}
@@ -0,0 +1,315 @@
+#!/usr/bin/env python3
+"""Offline Manchester decoder for raw edge captures.
+
+A capture is a flat file of little endian uint16 values, one per edge
+on one OpenTherm line, each the Timer 1 value (prescaler 8, ca 0.72 us
+per tick) since the previous edge, i.e. what in_handler() reads from
+TCNT1. The decoding itself is done by manch_decode() from
+firmware/manchester.c, built into libmanchdec.so together with the glue
+in manchdec.c (run 'make' in this directory). Captures are processed
+in large batches, straight from a memory map when numpy is available.
+
+Examples:
+
+  manchdec.py decode therm.bin
+  manchdec.py decode therm.bin --compare frames.bin
+  manchdec.py sweep therm.bin --t-min 400:600:50 --t2-max 1600:2000:100
+"""
+
+import argparse
+import ctypes
+import os
+import sys
+from array import array
+from collections import Counter
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+# Same defaults as firmware/constants.h
+T_MIN = 500
+T_MAX = 900
+T2_MIN = 1100
+T2_MAX = 1800
+T_TIMEOUT = 2 * 1382  # OCR1A
+T_GLITCH = 0       # spike filter off, as in the firmware; 200 turns it on
+
+BATCH = 1 << 20  # edges per call into the kernel
+MIN_EDGES_PER_FRAME = 34
+
+
+class _Windows(ctypes.Structure):
+    _fields_ = [("t_min", ctypes.c_uint16),
+                ("t_max", ctypes.c_uint16),
+                ("t2_min", ctypes.c_uint16),
+                ("t2_max", ctypes.c_uint16),
+                ("t_timeout", ctypes.c_uint16),
+                ("t_glitch", ctypes.c_uint16)]
+
+
+class _Undo(ctypes.Structure):
+    _fields_ = [("state", ctypes.c_uint8),
+                ("buff", ctypes.c_uint8),
+                ("i", ctypes.c_int8),
+                ("msg_bits_cntr", ctypes.c_int8),
+                ("buff_bits_cntr", ctypes.c_int8),
+                ("parity", ctypes.c_uint8),
+                ("prev_bit", ctypes.c_uint8),
+                ("value", ctypes.c_uint16)]
+
+
+class _In(ctypes.Structure):
+    _fields_ = [("msg", ctypes.c_uint8 * 4),
+                ("state", ctypes.c_uint8),
+                ("buff", ctypes.c_uint8),
+                ("i", ctypes.c_int8),
+                ("msg_bits_cntr", ctypes.c_int8),
+                ("buff_bits_cntr", ctypes.c_int8),
+                ("parity", ctypes.c_uint8),
+                ("prev_bit", ctypes.c_uint8),
+                ("hold", ctypes.c_uint8),
+                ("recovered", ctypes.c_uint8),
+                ("carry", ctypes.c_uint16),
+                ("undo", _Undo)]
+
+
+class Stats(ctypes.Structure):
+    _fields_ = [("edges", ctypes.c_uint64),
+                ("frames", ctypes.c_uint64),
+                ("parity_errors", ctypes.c_uint64),
+                ("sync_errors", ctypes.c_uint64),
+                ("errors", ctypes.c_uint64),
+                ("timeouts", ctypes.c_uint64),
+                ("glitches", ctypes.c_uint64),
+                ("saved", ctypes.c_uint64)]
+
+    def __str__(self):
+        return ("edges %i frames %i parity errors %i sync errors %i "
+                "errors %i timeouts %i glitches %i saved %i" % (
+                    self.edges, self.frames, self.parity_errors, self.sync_errors,
+                    self.errors, self.timeouts, self.glitches, self.saved))
+
+
+_lib = None
+
+
+def _kernel():
+    global _lib
+    if _lib is None:
+        path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "libmanchdec.so")
+        try:
+            _lib = ctypes.CDLL(path)
+        except OSError:
+            raise RuntimeError("%s not found, run 'make' in %s first." %
+                               (path, os.path.dirname(path)))
+        _lib.md_decode.restype = ctypes.c_size_t
+        _lib.md_decode.argtypes = [ctypes.POINTER(_In), ctypes.POINTER(_Windows),
+                                   ctypes.c_void_p, ctypes.c_size_t,
+                                   ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t,
+                                   ctypes.POINTER(Stats), ctypes.c_uint64]
+        _lib.md_sweep.restype = None
+        _lib.md_sweep.argtypes = [ctypes.c_void_p, ctypes.c_size_t,
+                                  ctypes.POINTER(_Windows), ctypes.c_size_t,
+                                  ctypes.POINTER(Stats)]
+    return _lib
+
+
+class Windows(object):
+    """Decode windows, in Timer 1 ticks, as set with SET_T_MIN etc."""
+
+    def __init__(self, t_min=T_MIN, t_max=T_MAX, t2_min=T2_MIN, t2_max=T2_MAX,
+                 t_timeout=T_TIMEOUT, t_glitch=T_GLITCH):
+        self.t_min = t_min
+        self.t_max = t_max
+        self.t2_min = t2_min
+        self.t2_max = t2_max
+        self.t_timeout = t_timeout
+        self.t_glitch = t_glitch
+
+    def _c(self):
+        return _Windows(self.t_min, self.t_max, self.t2_min, self.t2_max, self.t_timeout,
+                        self.t_glitch)
+
+    def __repr__(self):
+        return "t_min=%i t_max=%i t2_min=%i t2_max=%i t_glitch=%i" % (
+            self.t_min, self.t_max, self.t2_min, self.t2_max, self.t_glitch)
+
+
+def load(path):
+    """Return the edge intervals of a capture file as an uint16 buffer,
+    memory mapped if numpy is available."""
+    n = os.path.getsize(path) // 2     # an odd trailing byte is ignored
+    if numpy is not None:
+        if n == 0:
+            return numpy.zeros(0, dtype="<u2")
+        return numpy.memmap(path, dtype="<u2", mode="r", shape=(n,))
+    ticks = array("H")
+    with open(path, "rb") as f:
+        ticks.fromfile(f, n)
+    if sys.byteorder != "little":
+        ticks.byteswap()
+    return ticks
+
+
+def _address(buf, offset):
+    if numpy is not None and isinstance(buf, numpy.ndarray):
+        return buf.ctypes.data + offset * buf.itemsize
+    return buf.buffer_info()[0] + offset * buf.itemsize
+
+
+class Decoder(object):
+    """Streaming decoder for one OpenTherm line. Feed it batches of edge
+    intervals; the state of the Manchester state machine is kept between
+    batches."""
+
+    def __init__(self, windows=None):
+        self.windows = windows or Windows()
+        self.stats = Stats()
+        self._in = _In()
+        self._w = self.windows._c()
+        self._edges = 0
+
+    def feed(self, ticks, start=0, stop=None):
+        """Decode ticks[start:stop] and return a list of (edge index,
+        frame) tuples. The frame is a 32 bit integer including the parity
+        bit, as the gateway sends it to the host."""
+        lib = _kernel()
+        stop = len(ticks) if stop is None else stop
+        found = []
+        while start < stop:
+            n = min(BATCH, stop - start)
+            max_frames = n // MIN_EDGES_PER_FRAME + 1
+            frames = (ctypes.c_uint32 * max_frames)()
+            pos = (ctypes.c_uint64 * max_frames)()
+            k = lib.md_decode(ctypes.byref(self._in), ctypes.byref(self._w),
+                              _address(ticks, start), n,
+                              ctypes.addressof(frames), ctypes.addressof(pos), max_frames,
+                              ctypes.byref(self.stats), self._edges)
+            found.extend(zip(pos[:k], frames[:k]))
+            self._edges += n
+            start += n
+        return found
+
+
+def decode(ticks, windows=None):
+    """Decode a whole capture, return (frames, stats)."""
+    d = Decoder(windows)
+    frames = d.feed(ticks)
+    return frames, d.stats
+
+
+def sweep(ticks, settings):
+    """Decode the same capture once per Windows in settings, return a
+    list of Stats in the same order."""
+    lib = _kernel()
+    settings = list(settings)
+    w = (_Windows * len(settings))(*[s._c() for s in settings])
+    stats = (Stats * len(settings))()
+    lib.md_sweep(_address(ticks, 0), len(ticks), w, len(settings), stats)
+    return list(stats)
+
+
+def ordered(w):
+    """Windows the decoder can use: a spike is shorter than a half bit
+    and a half bit is shorter than a whole bit."""
+    return w.t_glitch <= w.t_min <= w.t_max < w.t2_min <= w.t2_max
+
+
+WINDOW_ATTRS = ("t_min", "t_max", "t2_min", "t2_max", "t_glitch")
+
+
+def best(settings, stats):
+    """Pick the window settings to use: of all ordered settings that
+    decode the most frames, the one closest to the center of that
+    region, so the margin to both sides is as large as possible. The
+    distance per parameter is relative to the spread of that parameter
+    in the region. Always one of the settings that was tried."""
+    scored = [(w, s) for w, s in zip(settings, stats) if ordered(w)]
+    if not scored:
+        raise ValueError("No ordered window settings.")
+    top = max(s.frames for w, s in scored)
+    good = [w for w, s in scored if s.frames == top]
+    center, spread = {}, {}
+    for attr in WINDOW_ATTRS:
+        values = sorted(getattr(w, attr) for w in good)
+        center[attr] = (values[0] + values[-1]) / 2.0
+        spread[attr] = float(values[-1] - values[0]) or 1.0
+    return min(good, key=lambda w: sum(((getattr(w, a) - center[a]) / spread[a]) ** 2
+                                       for a in WINDOW_ATTRS))
+
+
+def load_frames(path):
+    """Read a file of 4 byte frames, msb first, as the host receives
+    them from the gateway."""
+    with open(path, "rb") as f:
+        data = bytearray(f.read())
+    return [(data[i] << 24) | (data[i + 1] << 16) | (data[i + 2] << 8) | data[i + 3]
+            for i in range(0, len(data) - 3, 4)]
+
+
+def compare(decoded, reference):
+    """Compare decoded frames with the frames the firmware delivered.
+    Returns (common, only_decoded, only_reference) counts."""
+    a = Counter(decoded)
+    b = Counter(reference)
+    common = sum((a & b).values())
+    return (common, sum(a.values()) - common, sum(b.values()) - common)
+
+
+def _range(spec, default):
+    if spec is None:
+        return [default]
+    parts = [int(p) for p in spec.split(":")]
+    if len(parts) == 1:
+        return parts
+    step = parts[2] if len(parts) > 2 else 1
+    return list(range(parts[0], parts[1] + 1, step))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Offline Manchester decoder.")
+    parser.add_argument("command", choices=["decode", "sweep"])
+    parser.add_argument("capture", help="File with uint16 edge intervals.")
+    parser.add_argument("--t-min", help="Value, or start:stop:step for sweep.")
+    parser.add_argument("--t-max")
+    parser.add_argument("--t2-min")
+    parser.add_argument("--t2-max")
+    parser.add_argument("--t-glitch", help="Spike filter, 0 (default) is off, 200 as SET_T_GLITCH 200.")
+    parser.add_argument("--compare", metavar="FRAMES",
+                        help="File with the frames the gateway delivered.")
+    parser.add_argument("--quiet", action="store_true", help="Don't print frames.")
+    args = parser.parse_args()
+
+    ticks = load(args.capture)
+    t_min = _range(args.t_min, T_MIN)
+    t_max = _range(args.t_max, T_MAX)
+    t2_min = _range(args.t2_min, T2_MIN)
+    t2_max = _range(args.t2_max, T2_MAX)
+    t_glitch = _range(args.t_glitch, T_GLITCH)
+
+    if args.command == "decode":
+        w = Windows(t_min[0], t_max[0], t2_min[0], t2_max[0], t_glitch=t_glitch[0])
+        frames, stats = decode(ticks, w)
+        if not args.quiet:
+            for pos, frame in frames:
+                print("%i\t%08x" % (pos, frame))
+        print(stats)
+        if args.compare:
+            common, mine, theirs = compare([f for _, f in frames], load_frames(args.compare))
+            print("common %i only decoded %i only gateway %i" % (common, mine, theirs))
+    else:
+        settings = [Windows(a, b, c, d, t_glitch=g) for a in t_min for b in t_max
+                    for c in t2_min for d in t2_max for g in t_glitch]
+        settings = [w for w in settings if ordered(w)]
+        if not settings:
+            raise ValueError("No valid window settings in sweep.")
+        stats = sweep(ticks, settings)
+        for w, s in sorted(zip(settings, stats), key=lambda ws: -ws[1].frames):
+            print("%s\t%s" % (w, s))
+        print("best: %s" % best(settings, stats))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+"""Round trip latency of INTERCEPT mode.
+
+In INTERCEPT mode the thermostat only gets an answer when the host
+sends one, so the time from the last edge of a request on FROM_THERM to
+the first edge of the answer on TO_THERM decides whether interception
+works. Here the host answers every request itself, as a boiler would,
+and after each answer reads where the time went from firmware built
+with -DBENCH (make bench, or otgw-sim-bench in the simulator) with
+GET_BENCH:
+
+  receive   request complete in in_handler() -> receive() in the main loop
+  to_host   -> last byte in cb_out (uputc)
+  host      -> answer from the host complete in the main loop: the UART
+               both ways, the OS and Python
+  python    part of host: read by the engine -> answer written
+  send      -> first edge on TO_THERM, send() and waiting for timer 0
+  total     last edge FROM_THERM -> first edge TO_THERM
+
+The firmware stages are in units of 16 ticks of timer 1, about 11.6 us.
+In the simulator they are simulated time, so use -s 1 there, and the
+main loop stages are only as fine as the simulator tick (-t).
+
+Examples:
+
+  otgw-sim-bench -r 2 -s 1 -t 1000 -l /tmp/otgw &
+  otbench.py --port /tmp/otgw -n 200 --histogram
+"""
+
+import argparse
+import asyncio
+import math
+import signal
+import sys
+import time
+
+import otcodec
+import otengine
+import othost
+from othost import DO_INTERCEPT, GET_BENCH, GWIOException, UnknownCommand
+
+F_CPU = 11059200
+BENCH_UNIT = 16                             # ticks per unit, see protocol.h
+UNIT_US = BENCH_UNIT * 8 * 1e6 / F_CPU      # timer 1 runs at F_CPU / 8
+
+# Points of GET_BENCH, same as BENCH_* in firmware/protocol.h
+BENCH_COUNT = 0
+BENCH_RECEIVE = 1
+BENCH_TO_HOST = 2
+BENCH_HOST = 3
+BENCH_SEND = 4
+BENCH_TOTAL = 5
+
+STAGES = ("receive", "to_host", "host", "python", "send", "total")
+FIRMWARE = ((BENCH_RECEIVE, "receive"), (BENCH_TO_HOST, "to_host"), (BENCH_HOST, "host"),
+            (BENCH_SEND, "send"), (BENCH_TOTAL, "total"))
+RESULT_TIMEOUT = 0.5        # wait for the answer to go out on TO_THERM
+POLL = 0.002
+
+
+def percentile(values, q):
+    """Nearest rank percentile of sorted values."""
+    return values[max(0, min(len(values) - 1, int(math.ceil(q * len(values))) - 1))]
+
+
+def answer(msg):
+    """Answer of a boiler to a request: READ_ACK / WRITE_ACK with the
+    same DataID, or None for frames that are not a request."""
+    msg_type, data_id, raw = otcodec.parse(msg)
+    if msg_type == otcodec.READ_DATA:
+        return otcodec.build(otcodec.READ_ACK, data_id, 0, with_parity=False)
+    if msg_type == otcodec.WRITE_DATA:
+        return otcodec.build(otcodec.WRITE_ACK, data_id, raw, with_parity=False)
+    return None
+
+
+class Bench(object):
+
+    def __init__(self, engine, count):
+        self.engine = engine
+        self.count = count
+        self.samples = dict((s, []) for s in STAGES)
+        self.answered = 0
+        self.missed = 0             # no complete measurement after an answer
+        self._answers = None        # python stage in us per answer sent
+        self._last = None           # BENCH_COUNT of the last measurement
+
+    def _on_frame(self, ts, msg):
+        reply = answer(msg)
+        if reply is None or self.engine.state != otengine.RUNNING:
+            return
+        self.engine.send(reply)
+        self.answered += 1
+        self._answers.put_nowait((self.engine.clock() - ts) * 1e6)
+
+    async def _read(self, point):
+        msb, lsb = await self.engine.command(GET_BENCH, point)
+        return (msb << 8) + lsb
+
+    async def _collect(self):
+        loop = asyncio.get_running_loop()
+        while len(self.samples["total"]) < self.count:
+            python = await self._answers.get()
+            deadline = loop.time() + RESULT_TIMEOUT
+            n = await self._read(BENCH_COUNT)
+            while n == self._last and loop.time() < deadline:
+                await asyncio.sleep(POLL)
+                n = await self._read(BENCH_COUNT)
+            if n == self._last:
+                self.missed += 1
+                continue
+            values = [await self._read(point) for point, _ in FIRMWARE]
+            if await self._read(BENCH_COUNT) != n or self._answers.qsize():
+                self._last = n      # overtaken by the next request
+                self.missed += 1
+                continue
+            self._last = n
+            for (_, name), v in zip(FIRMWARE, values):
+                self.samples[name].append(v * UNIT_US)
+            self.samples["python"].append(python)
+
+    async def run(self):
+        """Until count round trips are measured or the engine stops."""
+        self._answers = asyncio.Queue()
+        try:
+            self._last = await self._read(BENCH_COUNT)
+        except UnknownCommand:
+            raise GWIOException("Gateway does not know GET_BENCH, is the firmware built with make bench?")
+        self.engine.consume(self._on_frame, match=lambda msg: otcodec.parse(msg)[0] < otcodec.READ_ACK)
+        collector = asyncio.ensure_future(self._collect())
+        try:
+            await asyncio.wait([collector, self.engine.done], return_when=asyncio.FIRST_COMPLETED)
+        finally:
+            collector.cancel()
+        if collector.done() and not collector.cancelled():
+            collector.result()
+
+    def report(self, histogram=False, out=sys.stdout):
+        print("%-8s %6s %10s %10s %10s" % ("stage", "n", "p50 us", "p99 us", "max us"), file=out)
+        for name in STAGES:
+            v = sorted(self.samples[name])
+            if not v:
+                continue
+            print("%-8s %6i %10.1f %10.1f %10.1f" % (
+                name, len(v), percentile(v, 0.5), percentile(v, 0.99), v[-1]), file=out)
+        print("answered %i, missed %i" % (self.answered, self.missed), file=out)
+        if histogram:
+            for name in STAGES:
+                print_histogram(name, self.samples[name], out)
+        out.flush()
+
+
+def print_histogram(name, values, out=sys.stdout, width=40):
+    """Buckets of powers of two in us."""
+    if not values:
+        return
+    buckets = {}
+    for v in values:
+        b = 0 if v < 1 else int(math.log2(v)) + 1
+        buckets[b] = buckets.get(b, 0) + 1
+    top = max(buckets.values())
+    print("\n%s" % name, file=out)
+    for b in range(min(buckets), max(buckets) + 1):
+        n = buckets.get(b, 0)
+        print("  < %8i us %6i %s" % (1 << b, n, "#" * int(math.ceil(n * width / top))), file=out)
+
+
+async def main(args):
+    import serial
+
+    ser = serial.Serial(args.port, 115200, timeout=0)
+    engine = otengine.Engine(ser, DO_INTERCEPT, clock=time.perf_counter,
+                             setup=[othost.set_windows])
+    bench = Bench(engine, args.n)
+    loop = asyncio.get_running_loop()
+    for sig in (signal.SIGINT, signal.SIGTERM):
+        loop.add_signal_handler(sig, lambda: asyncio.ensure_future(engine.close()))
+    if args.T:
+        loop.call_later(args.T, lambda: asyncio.ensure_future(engine.close()))
+
+    await engine.start()
+    try:
+        await bench.run()
+    except GWIOException as e:
+        print(e, file=sys.stderr)
+    finally:
+        await engine.close()
+        ser.close()
+        bench.report(args.histogram)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Round trip latency of INTERCEPT mode.")
+    parser.add_argument("--port", default="/dev/ttyAMA0", help="Serial port of the gateway.")
+    parser.add_argument("-n", type=int, default=100, help="Number of round trips.")
+    parser.add_argument("--histogram", action="store_true", help="Histogram per stage.")
+    parser.add_argument("-T", type=float, help="Stop after this many seconds.")
+    asyncio.run(main(parser.parse_args()))
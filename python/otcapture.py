@@ -0,0 +1,384 @@
+#!/usr/bin/env python3
+"""Record and replay OpenTherm gateway sessions.
+
+A capture file is append only: a 16 byte header followed by fixed size
+16 byte records, so it can be memory mapped and searched without
+parsing. Every record holds one 4 byte frame as it went over the serial
+line between host and gateway:
+
+  offset  size  field
+       0     8  timestamp, ns since the epoch, little endian, never decreasing
+       8     1  direction, GW_TO_HOST or HOST_TO_GW
+       9     1  kind, FRAME or BYTE (handshake characters ENQ / SYN / ACK)
+      10     2  reserved, 0
+      12     4  frame, msb first
+
+From version 2 of the header on, OpenTherm frames from the gateway keep
+their parity bit, as the gateway now sends them. Version 1 captures are
+still read; ReplaySerial adds the parity bit to their frames.
+
+Captures are read with Capture, which indexes records by time (binary
+search on the timestamps) and by DataID (built on first use). A
+ReplaySerial feeds a capture back into the host code in othost.py in
+place of the serial port, at real time, accelerated (up to 1000x and
+beyond) or as fast as possible.
+
+Examples:
+
+  otcapture.py info week.otc
+  otcapture.py dump week.otc --data-id 25 --start 2015-03-01T12:00
+"""
+
+import argparse
+import bisect
+import mmap
+import os
+import struct
+import threading
+import time
+from datetime import datetime
+
+import otcodec
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+MAGIC = b"OTCAP\x00\x02\x00"
+MAGIC_V1 = b"OTCAP\x00\x01\x00"      # frames from the gateway without parity bit
+HEADER = struct.Struct("<8sQ")
+RECORD = struct.Struct("<QBBH4s")
+
+GW_TO_HOST = 0
+HOST_TO_GW = 1
+
+FRAME = 0
+BYTE = 1
+
+# Frame bits, see firmware/protocol.h
+MSGID_MSK = 0x70
+MSG_HOST_TO_GW = 0x30
+ENQ = 0x05
+SYN = 0x16
+ACK = 0x06
+CREDIT = 0x17
+
+
+class Recorder(object):
+    """Append frames to a capture file. Timestamps are made monotonic so
+    the time index stays valid when the wall clock is adjusted."""
+
+    def __init__(self, path, clock=time.time, flush_every=64):
+        new = not os.path.exists(path) or os.path.getsize(path) == 0
+        self._f = open(path, "ab")
+        self._clock = clock
+        self._last = 0
+        self._pending = 0
+        self._flush_every = flush_every
+        if new:
+            self._f.write(HEADER.pack(MAGIC, int(clock() * 1e9)))
+            self._f.flush()
+        else:
+            with open(path, "rb") as f:
+                if f.read(len(MAGIC)) != MAGIC:
+                    self._f.close()
+                    raise ValueError("%s is not a version 2 capture file, record to a new one." % path)
+            size = os.path.getsize(path)
+            # Drop a partial record left behind by a crash.
+            tail = (size - HEADER.size) % RECORD.size
+            if tail:
+                self._f.truncate(size - tail)
+            if size - tail > HEADER.size:
+                with open(path, "rb") as f:
+                    f.seek(size - tail - RECORD.size)
+                    self._last = RECORD.unpack(f.read(RECORD.size))[0]
+
+    def record(self, direction, frame, kind=FRAME):
+        ts = max(int(self._clock() * 1e9), self._last)
+        self._last = ts
+        if kind == BYTE:
+            frame = bytearray([frame, 0, 0, 0])
+        self._f.write(RECORD.pack(ts, direction, kind, 0, bytes(frame)))
+        self._pending += 1
+        if self._pending >= self._flush_every:
+            self.flush()
+
+    def flush(self):
+        self._f.flush()
+        self._pending = 0
+
+    def close(self):
+        self._f.close()
+
+
+class Capture(object):
+    """Read only, memory mapped view of a capture file."""
+
+    def __init__(self, path):
+        self._f = open(path, "rb")
+        size = os.fstat(self._f.fileno()).st_size
+        if size < HEADER.size:
+            raise ValueError("%s is not a capture file." % path)
+        self._map = mmap.mmap(self._f.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, self.created = HEADER.unpack_from(self._map, 0)
+        if magic not in (MAGIC, MAGIC_V1):
+            raise ValueError("%s is not a capture file." % path)
+        self.version = magic[6]
+        self.count = (size - HEADER.size) // RECORD.size
+        self._by_id = None
+        self._times = _Times(self)
+
+    def __len__(self):
+        return self.count
+
+    def __getitem__(self, n):
+        """Return (timestamp ns, direction, kind, frame) of record n."""
+        if n < 0:
+            n += self.count
+        if not 0 <= n < self.count:
+            raise IndexError(n)
+        ts, d, k, _, frame = RECORD.unpack_from(self._map, HEADER.size + n * RECORD.size)
+        return ts, d, k, bytearray(frame)
+
+    def __iter__(self):
+        return self.records()
+
+    def records(self, start=0, stop=None):
+        stop = self.count if stop is None else min(stop, self.count)
+        for n in range(start, stop):
+            yield self[n]
+
+    def index_at(self, ts):
+        """Number of the first record at or after ts (ns)."""
+        return bisect.bisect_left(self._times, ts)
+
+    def between(self, start=None, stop=None):
+        """Records with start <= timestamp < stop, times in ns."""
+        first = 0 if start is None else self.index_at(start)
+        last = self.count if stop is None else self.index_at(stop)
+        return self.records(first, last)
+
+    def _build_id_index(self):
+        by_id = {}
+        if numpy is not None and self.count:
+            rec = numpy.dtype([("ts", "<u8"), ("dir", "u1"), ("kind", "u1"),
+                               ("res", "<u2"), ("frame", "u1", 4)])
+            a = numpy.frombuffer(self._map, dtype=rec, count=self.count, offset=HEADER.size)
+            frames = a["kind"] == FRAME
+            ids = a["frame"][:, 1]
+            for i in numpy.unique(ids[frames]):
+                by_id[int(i)] = numpy.nonzero(frames & (ids == i))[0]
+        else:
+            for n in range(self.count):
+                _, _, k, frame = self[n]
+                if k == FRAME:
+                    by_id.setdefault(frame[1], []).append(n)
+        self._by_id = by_id
+
+    def data_id(self, i, start=None, stop=None):
+        """Records carrying DataID i (or gateway command i for HOST_TO_GW
+        frames), optionally limited to start <= timestamp < stop."""
+        if self._by_id is None:
+            self._build_id_index()
+        idx = self._by_id.get(i, [])
+        if start is not None or stop is not None:
+            lo = 0 if start is None else self.index_at(start)
+            hi = self.count if stop is None else self.index_at(stop)
+            idx = idx[bisect.bisect_left(idx, lo):bisect.bisect_left(idx, hi)]
+        for n in idx:
+            yield self[int(n)]
+
+    def data_ids(self):
+        if self._by_id is None:
+            self._build_id_index()
+        return sorted(self._by_id)
+
+    def close(self):
+        self._map.close()
+        self._f.close()
+
+
+class _Times(object):
+    """Sequence view on the record timestamps for bisect."""
+
+    def __init__(self, capture):
+        self._c = capture
+
+    def __len__(self):
+        return self._c.count
+
+    def __getitem__(self, n):
+        return struct.unpack_from("<Q", self._c._map, HEADER.size + n * RECORD.size)[0]
+
+
+class ReplayDone(Exception):
+    pass
+
+
+class ReplaySerial(object):
+    """Stands in for serial.Serial in othost.py and plays back the
+    gateway side of a capture. The handshake and the gateway commands
+    are answered like the firmware does; all recorded frames from the
+    gateway that are not command replies are delivered at their
+    recorded time, scaled by speed (0 = as fast as possible). The host
+    code must use clock() instead of time() to see the replayed time.
+    Frames the host sends to the bus are collected in sent. read() and
+    write() may be called from different threads."""
+
+    def __init__(self, capture, speed=1.0, timeout=10, start=None, stop=None):
+        self._cap = capture
+        self._records = capture.between(start, stop)
+        self._speed = speed
+        self.timeout = timeout
+        self._rx = bytearray([ENQ])
+        self._tx = bytearray()
+        self._values = {}
+        self._next = None
+        self._vnow = None
+        self._wall0 = None
+        self.sent = []
+        self.delivered = 0
+        self._lock = threading.Lock()
+        self._advance()
+        self._vnow = self._next[0] / 1e9 if self._next else time.time()
+        self._v0 = self._vnow
+
+    def _advance(self):
+        for ts, d, k, frame in self._records:
+            if d == GW_TO_HOST and k == FRAME and (frame[0] & MSGID_MSK) != MSG_HOST_TO_GW:
+                if self._cap.version == 1:
+                    frame[0] |= otcodec.parity(frame) << 7
+                self._next = (ts, frame)
+                return
+        self._next = None
+
+    def clock(self):
+        """Replayed time in seconds since the epoch."""
+        return self._vnow
+
+    def _sleep_until(self, v):
+        if v <= self._vnow:
+            return
+        if self._speed:
+            if self._wall0 is None:
+                self._wall0 = time.time()
+            wall = self._wall0 + (v - self._v0) / self._speed
+            delay = wall - time.time()
+            if delay > 0:
+                time.sleep(delay)
+        self._vnow = v
+
+    def _fill(self, n):
+        while len(self._rx) < n:
+            if self._next is None:
+                raise ReplayDone()
+            due = self._next[0] / 1e9
+            if due - self._vnow > self.timeout:
+                self._sleep_until(self._vnow + self.timeout)
+                return
+            self._sleep_until(due)
+            with self._lock:
+                self._rx += self._next[1]
+            self.delivered += 1
+            self._advance()
+
+    @property
+    def in_waiting(self):
+        return len(self._rx)
+
+    def read(self, size=1):
+        self._fill(size)
+        with self._lock:
+            data, self._rx = self._rx[:size], self._rx[size:]
+        return bytes(data)
+
+    def readinto(self, buf):
+        data = self.read(len(buf))
+        buf[:len(data)] = data
+        return len(data)
+
+    def write(self, data):
+        with self._lock:
+            return self._write(data)
+
+    def _write(self, data):
+        self._tx += bytearray(data)
+        if self._tx[:1] == bytearray([SYN]):
+            del self._tx[0]
+            self._rx += bytearray([ACK])
+        while len(self._tx) >= 4:
+            msg, self._tx = self._tx[:4], self._tx[4:]
+            if (msg[0] & MSGID_MSK) == MSG_HOST_TO_GW:
+                self._rx += self._process_cmd(msg)
+            else:
+                self.sent.append((self._vnow, msg))
+                self._rx += bytearray([MSG_HOST_TO_GW, CREDIT, 0, 1])
+        return len(data)
+
+    def _process_cmd(self, msg):
+        # Like process_cmd() in the firmware.
+        cmd = msg[1]
+        if cmd == 0x02:  # PING
+            msg[3] = 1
+        elif cmd & 0x80:  # SET_*
+            self._values[cmd & 0x7F] = (msg[2], msg[3])
+        elif cmd in self._values:  # GET_*
+            msg[2], msg[3] = self._values[cmd]
+        return msg
+
+    def flush(self):
+        pass
+
+    def close(self):
+        pass
+
+
+def _parse_time(s):
+    if s is None:
+        return None
+    for fmt in ("%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d"):
+        try:
+            return int(time.mktime(datetime.strptime(s, fmt).timetuple()) * 1e9)
+        except ValueError:
+            pass
+    raise ValueError("Bad time %s" % s)
+
+
+def _repr(rec):
+    ts, d, k, frame = rec
+    when = datetime.fromtimestamp(ts / 1e9).isoformat()
+    arrow = "<-" if d == GW_TO_HOST else "->"
+    if k == BYTE:
+        return "%s\t%s\t%02x" % (when, arrow, frame[0])
+    return "%s\t%s\t%02x %02x %02x%02x" % (when, arrow, frame[0], frame[1], frame[2], frame[3])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="OpenTherm capture files.")
+    parser.add_argument("command", choices=["info", "dump"])
+    parser.add_argument("capture")
+    parser.add_argument("--data-id", type=int)
+    parser.add_argument("--start", help="YYYY-MM-DDTHH:MM[:SS]")
+    parser.add_argument("--stop", help="YYYY-MM-DDTHH:MM[:SS]")
+    args = parser.parse_args()
+
+    cap = Capture(args.capture)
+    start, stop = _parse_time(args.start), _parse_time(args.stop)
+    if args.command == "info":
+        print("records: %i" % len(cap))
+        if len(cap):
+            print("from: %s" % datetime.fromtimestamp(cap[0][0] / 1e9).isoformat())
+            print("to: %s" % datetime.fromtimestamp(cap[-1][0] / 1e9).isoformat())
+            print("data ids: %s" % " ".join(str(i) for i in cap.data_ids()))
+    elif args.data_id is not None:
+        for rec in cap.data_id(args.data_id, start, stop):
+            print(_repr(rec))
+    else:
+        for rec in cap.between(start, stop):
+            print(_repr(rec))
+    cap.close()
+
+
+if __name__ == '__main__':
+    main()
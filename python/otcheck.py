@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+"""Robustness of the frame parser in othost.py.
+
+Streams as the gateway sends them in MONITOR mode, requests and replies
+with mostly zero values plus CREDIT and PING replies, lose 1 to 3 bytes
+at a random place and are fed to a FrameParser in random chunks. The
+parser may drop a few frames around the lost bytes and may pass on the
+frame the bytes were lost from, which can look as good as any, but all
+other frames it returns must have been sent, in order: a frame
+assembled at the wrong offset after that fails the check. The same for
+a parser that starts 1 to 3 bytes into the stream. Each stream ends
+with PING replies, as when the host goes quiet, so no frames are left
+waiting in the parser.
+
+Exit code 1 when a check fails.
+
+Examples:
+
+  otcheck.py -q
+  otcheck.py -n 20000 --seed 7
+"""
+
+import argparse
+import random
+import sys
+
+import otcodec
+from othost import CREDIT, HOST_TO_GW, PING, FrameParser
+
+FRAMES = 40             # frames per stream
+TAIL = 20               # PING replies after them
+MAX_LOST = 8            # frames the parser may drop around the lost bytes
+MAX_WRONG = 5           # frames it may make of the bytes around them
+FRAME_BYTES = 4
+
+# DataIDs a thermostat reads and writes, values that are zero more often than not.
+READ_IDS = (0, 0, 0, 3, 5, 17, 18, 25, 25, 26, 27, 28, 56, 57)
+WRITE_IDS = (1, 1, 14, 16, 56)
+
+
+def value(rnd, zeros):
+    if rnd.random() < zeros:
+        return 0
+    return rnd.choice((0x0100, 0x4000, 0x0040, 0x1900, rnd.getrandbits(16)))
+
+
+def stream(rnd, zeros):
+    """FRAMES frames from the gateway as a list of bytes."""
+    frames = []
+    while len(frames) < FRAMES:
+        r = rnd.random()
+        if r < 0.1:
+            frames.append(bytes((HOST_TO_GW, CREDIT, 0, 1)))
+            continue
+        if r < 0.15:
+            frames.append(bytes((HOST_TO_GW, PING, 0, 1)))
+            continue
+        if rnd.random() < 0.8:
+            data_id = rnd.choice(READ_IDS)
+            frames.append(otcodec.build(otcodec.READ_DATA, data_id, 0))
+            frames.append(otcodec.build(otcodec.READ_ACK, data_id, value(rnd, zeros)))
+        else:
+            data_id = rnd.choice(WRITE_IDS)
+            v = value(rnd, zeros)
+            frames.append(otcodec.build(otcodec.WRITE_DATA, data_id, v))
+            frames.append(otcodec.build(otcodec.WRITE_ACK, data_id, v))
+    return frames[:FRAMES] + [bytes((HOST_TO_GW, PING, 0, 1))] * TAIL
+
+
+def feed(parser, data, rnd):
+    got = []
+    pos = 0
+    while pos < len(data):
+        k = rnd.randint(1, 12)
+        got += parser.feed(data[pos:pos + k])
+        pos += k
+    return [bytes(f) for f in got]
+
+
+def in_order(got, sent):
+    """Is got sent with at most MAX_LOST frames in one place left out,
+    and at most MAX_WRONG frames that were not sent in their place?"""
+    n = min(len(got), len(sent))
+    head = 0
+    while head < n and got[head] == sent[head]:
+        head += 1
+    tail = 0
+    while tail < n - head and got[-1 - tail] == sent[-1 - tail]:
+        tail += 1
+    return len(got) - head - tail <= MAX_WRONG and len(sent) - head - tail <= MAX_LOST
+
+
+def check(n, zeros, lost, at_start, rnd):
+    failed = 0
+    for _ in range(n):
+        sent = stream(rnd, zeros)
+        data = b"".join(sent)
+        if at_start:
+            cut = 0
+        else:
+            cut = rnd.randrange(FRAME_BYTES, FRAMES * FRAME_BYTES)
+        data = data[:cut] + data[cut + lost:]
+        got = feed(FrameParser(), data, rnd)
+        if not in_order(got, sent):
+            failed += 1
+    return failed
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Robustness of the frame parser.")
+    parser.add_argument("-n", type=int, default=2000, help="Streams per check.")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("-q", action="store_true", help="Fewer streams, for make check.")
+    args = parser.parse_args()
+
+    rnd = random.Random(args.seed)
+    n = 300 if args.q else args.n
+    bad = 0
+    for zeros in (0.5, 0.9, 1.0):
+        for at_start in (False, True):
+            for lost in (1, 2, 3):
+                failed = check(n, zeros, lost, at_start, rnd)
+                bad += failed
+                print("zeros %3i%%, %i byte%s %-8s: %i / %i failed" % (
+                    zeros * 100, lost, "s" if lost > 1 else " ",
+                    "at start" if at_start else "lost", failed, n))
+    sys.exit(1 if bad else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+"""OpenTherm frame codec for the host.
+
+Frames are 4 bytes, msb first: parity, msg-type and spare bits, DataID
+and a 16 bit data value. The work is done by the same C code the
+firmware uses, firmware/otcodec.c, built into libotcodec.so with 'make'
+in this directory: parity, building frames, the type of each DataID
+and the values, so there is one table and one implementation.
+decode() turns a whole batch of frames into arrays in one call into
+the library.
+
+  batch = otcodec.decode(b"".join(frames))
+  for t, i, v in zip(batch.type, batch.data_id, batch.value):
+      ...
+
+Examples:
+
+  otcodec.py bench
+  otcodec.py decode 401a3700 c0190000
+"""
+
+import argparse
+import ctypes
+import os
+import struct
+import sys
+import time
+from array import array
+
+FRAME_BYTES = 4
+
+# msg-type, the high bit is the direction: 0 = master -> slave
+READ_DATA = 0
+WRITE_DATA = 1
+INVALID_DATA = 2
+RESERVED = 3
+READ_ACK = 4
+WRITE_ACK = 5
+DATA_INVALID = 6
+UNKNOWN_DATAID = 7
+
+# Data types, same values as firmware/otcodec.h. High nibble for the hb,
+# low nibble for the lb, OT_WORD in the high nibble for 16 bit values.
+NONE = 0x0
+FLAG8 = 0x1
+U8 = 0x2
+S8 = 0x3
+WORD = 0xF
+F88 = 0xF1
+U16 = 0xF2
+S16 = 0xF3
+
+_lib = None
+
+
+def _library():
+    """libotcodec.so, loaded on first use."""
+    global _lib
+    if _lib is None:
+        path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "libotcodec.so")
+        try:
+            lib = ctypes.CDLL(path)
+        except OSError:
+            raise OSError("libotcodec.so not built, run 'make' in %s." % os.path.dirname(path))
+        lib.ot_parity.restype = ctypes.c_uint8
+        lib.ot_parity.argtypes = [ctypes.c_char_p]
+        lib.ot_build_frame.restype = None
+        lib.ot_build_frame.argtypes = [ctypes.c_char_p, ctypes.c_uint8, ctypes.c_uint8, ctypes.c_uint16]
+        lib.ot_data_type.restype = ctypes.c_uint8
+        lib.ot_data_type.argtypes = [ctypes.c_uint8]
+        for f in (lib.ot_value, lib.ot_value_lb):
+            f.restype = ctypes.c_double
+            f.argtypes = [ctypes.c_char_p]
+        lib.ot_decode.restype = ctypes.c_size_t
+        lib.ot_decode.argtypes = [ctypes.c_char_p, ctypes.c_size_t,
+                                  ctypes.c_void_p, ctypes.c_void_p,
+                                  ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+        # ot_types of firmware/otcodec.c read once, for printing
+        lib.types = bytes(lib.ot_data_type(i) for i in range(0x100))
+        _lib = lib
+    return _lib
+
+
+def data_type(data_id):
+    """Type of a DataID, from ot_types in firmware/otcodec.c."""
+    return _library().types[data_id] if data_id < 0x100 else NONE
+
+
+def parity(msg):
+    """Parity of the 32 bits of msg, ot_parity()."""
+    return _library().ot_parity(bytes(msg[:FRAME_BYTES]))
+
+
+def build(msg_type, data_id, raw, with_parity=True):
+    """Frame as bytes, ot_build(). Frames to the gateway have no parity
+    bit, use with_parity=False for those. Frames from the gateway have
+    the parity bit they were received with."""
+    msg = ctypes.create_string_buffer(FRAME_BYTES)
+    _library().ot_build_frame(msg, msg_type, data_id, raw)
+    if not with_parity:
+        msg[0] = msg.raw[0] & 0x7F
+    return msg.raw
+
+
+def parse(msg):
+    """(msg-type, DataID, raw value) of a frame."""
+    return (msg[0] >> 4) & 0x07, msg[1], (msg[2] << 8) | msg[3]
+
+
+def value(msg):
+    """Value of a frame according to the type of its DataID, ot_value().
+    For two separate bytes this is the hb."""
+    return _library().ot_value(bytes(msg[:FRAME_BYTES]))
+
+
+def value_lb(msg):
+    """The lb of a frame with two separate bytes, ot_value_lb(), 0 for
+    16 bit values."""
+    return _library().ot_value_lb(bytes(msg[:FRAME_BYTES]))
+
+
+def flags(b):
+    """Numbers of the bits set in a FLAG8 byte."""
+    return tuple(k for k in range(8) if b & (1 << k))
+
+
+def _text_byte(t, v):
+    return format(int(v), "08b") if t == FLAG8 else "%i" % v
+
+
+def text(data_id, raw, v, lb):
+    """A value as decoded by decode() or value() / value_lb() for
+    printing: f8.8 with two decimals, FLAG8 bytes as bits, msb first,
+    and the raw value in hex for unknown DataIDs."""
+    t = data_type(data_id)
+    if t == NONE:
+        return "%04x" % raw
+    if t == F88:
+        return "%.2f" % v
+    if t >> 4 == WORD:
+        return "%i" % v
+    return "%s %s" % (_text_byte(t >> 4, v), _text_byte(t & 0x0F, lb))
+
+
+def from_f88(v):
+    """Raw value of a f8.8 temperature, for build()."""
+    return int(round(v * 256)) & 0xFFFF
+
+
+class Batch(object):
+    """Decoded frames, one array per field."""
+
+    def __init__(self, n):
+        self.type = array("B", [0]) * n
+        self.data_id = array("B", [0]) * n
+        self.raw = array("H", [0]) * n
+        self.value = array("d", [0]) * n
+        self.lb = array("d", [0]) * n
+
+    def __len__(self):
+        return len(self.type)
+
+
+def _decode_batch(frames, batch):
+    """All frames in one call of ot_decode()."""
+    if len(batch):
+        _library().ot_decode(frames, len(batch), batch.type.buffer_info()[0],
+                             batch.data_id.buffer_info()[0], batch.raw.buffer_info()[0],
+                             batch.value.buffer_info()[0], batch.lb.buffer_info()[0])
+
+
+def _decode_frames(frames, batch):
+    """Frame by frame with parse(), value() and value_lb()."""
+    for k in range(len(batch)):
+        msg = frames[FRAME_BYTES * k:FRAME_BYTES * (k + 1)]
+        batch.type[k], batch.data_id[k], batch.raw[k] = parse(msg)
+        batch.value[k] = value(msg)
+        batch.lb[k] = value_lb(msg)
+
+
+def decode(frames):
+    """Decode a bytes-like object with n frames back to back."""
+    frames = bytes(frames)
+    batch = Batch(len(frames) // FRAME_BYTES)
+    _decode_batch(frames, batch)
+    return batch
+
+
+def bench(n=100000):
+    """Decode cost per frame in ns, the whole batch in one call and
+    frame by frame. Both fill a Batch made beforehand."""
+    frames = struct.pack(">%iI" % n, *((0x40190000 | (k & 0x7FFF)) for k in range(n)))
+    result = {}
+    for name, f in (("batch", _decode_batch), ("frames", _decode_frames)):
+        batch = Batch(n)
+        t = time.perf_counter()
+        f(frames, batch)
+        result[name] = (time.perf_counter() - t) / n * 1e9
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="OpenTherm frame codec.")
+    sub = parser.add_subparsers(dest="action")
+    p = sub.add_parser("decode", help="Decode frames given in hex.")
+    p.add_argument("frames", nargs="+", help="Frames as 8 hex digits.")
+    p = sub.add_parser("bench", help="Decode cost per frame.")
+    p.add_argument("-n", type=int, default=100000, help="Frames per run.")
+    args = parser.parse_args()
+
+    if args.action == "decode":
+        batch = decode(b"".join(bytearray.fromhex(f) for f in args.frames))
+        for k in range(len(batch)):
+            print("%i\t%i\t%04x\t%s" % (batch.type[k], batch.data_id[k], batch.raw[k],
+                                         text(batch.data_id[k], batch.raw[k], batch.value[k], batch.lb[k])))
+    elif args.action == "bench":
+        for name, ns in sorted(bench(args.n).items()):
+            print("%-8s %8.1f ns/frame" % (name, ns))
+    else:
+        parser.print_help()
+        sys.exit(2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,464 @@
+#!/usr/bin/env python3
+"""Share one OpenTherm gateway between local programs.
+
+Only one process can own the serial port. otdaemon.py runs the session
+with otengine.Engine and offers it on a Unix domain socket, so a
+logger, an exporter and a control loop can run side by side.
+
+All messages are fixed size. From the daemon to a client, 13 bytes:
+
+  offset  size  field
+       0     1  kind, FRAME, REPLY, ERROR or CONTROL
+       1     8  timestamp, ns since the epoch, little endian
+       9     4  frame, msb first
+
+  FRAME    a frame from the bus, sent to every client
+  REPLY    reply of the gateway to a command of this client
+  ERROR    command or request refused or failed: frame is
+           HOST_TO_GW, cmd, reason, kind of the request
+  CONTROL  frame[0] is 1 if this client now has control, 0 if not
+
+From a client to the daemon, 5 bytes: kind and frame.
+
+  CMD      frame is HOST_TO_GW, cmd, msb, lsb
+  INJECT   an OpenTherm frame for the thermostat or boiler
+  ACQUIRE  ask for control
+  RELEASE  give control back
+
+Every client may send the GET_* commands of the gateway and PING. Commands that change
+the gateway (SET_*, DO_MONITOR, DO_INTERCEPT, RESTART) and INJECT need
+control, which one client at a time can have. Control is released
+when the owner disconnects. EOS is refused: the daemon ends the
+session itself.
+
+Frames of a read batch are encoded once into one buffer that is
+written to all clients. A client that does not keep up is paused by
+its transport when more than HIGH_WATER bytes are waiting; while it is
+paused, its frames are dropped, and after SLOW_TIMEOUT seconds it is
+disconnected, also when no frames come in the meantime. The serial
+reader never waits for a client.
+
+Examples:
+
+  otdaemon.py serve --port /dev/ttyAMA0 --socket /run/otgw.sock
+  otdaemon.py monitor --socket /run/otgw.sock
+  otdaemon.py command --socket /run/otgw.sock GET_T_MIN
+"""
+
+import argparse
+import asyncio
+import os
+import signal
+import socket
+import struct
+import sys
+import time
+from collections import deque
+
+import otcapture
+import othost
+from othost import (HOST_TO_GW, EOS, PING, DO_MONITOR, DO_INTERCEPT,
+                    GWIOException)
+
+SOCKET = "/run/otgw.sock"
+HIGH_WATER = 64 * 1024  # bytes waiting before a client counts as slow
+SLOW_TIMEOUT = 2.0      # s a client may stay slow before it is dropped
+MAX_PENDING = 16        # commands in flight per client
+QUEUE_SIZE = 8192       # frames between the engine and the broadcast
+
+# Message kinds, daemon to client
+FRAME = 0x01
+REPLY = 0x02
+ERROR = 0x03
+CONTROL = 0x04
+# Message kinds, client to daemon
+CMD = 0x10
+INJECT = 0x11
+ACQUIRE = 0x12
+RELEASE = 0x13
+
+# Reasons in an ERROR message
+DENIED = 0x01           # needs control, or refused
+FAILED = 0x02           # no reply from the gateway
+BUSY = 0x03             # too many commands in flight
+INVALID = 0x04          # unknown command or message kind
+
+OUT = struct.Struct("<BQ4s")
+IN = struct.Struct("<B4s")
+
+# Commands every client may send. Not GET_BENCH, only a BENCH build
+# knows it.
+read_only = frozenset([
+    PING, othost.GET_TEMPR, othost.GET_T_DIV, othost.GET_T, othost.GET_T2,
+    othost.GET_T_MIN, othost.GET_T_MAX, othost.GET_T2_MIN, othost.GET_T2_MAX,
+    othost.GET_LED, othost.GET_BAUD, othost.GET_PAR_ERR_CNT, othost.GET_FRM_ERR_CNT,
+    othost.GET_SYN_ERR_CNT, othost.GET_TEST, othost.GET_T_GLITCH, othost.GET_GLITCH_CNT,
+    othost.GET_SAVED_CNT, othost.GET_OVERRUN_CNT])
+
+
+def ns(ts):
+    return int(ts * 1e9)
+
+
+class ClientProtocol(asyncio.Protocol):
+
+    def __init__(self, daemon):
+        self.daemon = daemon
+        self.transport = None
+        self.paused = False
+        self.pending = 0
+        self.dropped = 0
+        self._buf = bytearray()
+        self._slow = None           # timer that drops the client while it is paused
+
+    def connection_made(self, transport):
+        self.transport = transport
+        transport.set_write_buffer_limits(high=HIGH_WATER)
+        self.daemon.clients.add(self)
+        self.daemon.stats["clients"] += 1
+
+    def connection_lost(self, exc):
+        self.resume_writing()
+        self.daemon.remove(self)
+
+    def pause_writing(self):
+        self.paused = True
+        self._slow = asyncio.get_running_loop().call_later(SLOW_TIMEOUT, self._too_slow)
+
+    def resume_writing(self):
+        self.paused = False
+        if self._slow:
+            self._slow.cancel()
+            self._slow = None
+
+    def _too_slow(self):
+        """Still paused after SLOW_TIMEOUT, also when the bus is quiet."""
+        self._slow = None
+        self.daemon.stats["slow"] += 1
+        self.transport.abort()
+
+    def data_received(self, data):
+        self._buf += data
+        n = len(self._buf) - len(self._buf) % IN.size
+        for off in range(0, n, IN.size):
+            kind, msg = IN.unpack_from(self._buf, off)
+            self.daemon.request(self, kind, msg)
+        del self._buf[:n]
+
+    def send(self, kind, msg, ts=None):
+        if not self.transport.is_closing():
+            self.transport.write(OUT.pack(kind, ns(self.daemon.engine.clock() if ts is None else ts), bytes(msg)))
+
+    def error(self, cmd, reason, kind=CMD):
+        self.send(ERROR, (HOST_TO_GW, cmd, reason, kind))
+
+
+class Daemon(object):
+
+    def __init__(self, engine, path=SOCKET):
+        self.engine = engine
+        self.path = path
+        self.clients = set()
+        self.owner = None
+        self.stats = dict(clients=0, slow=0, dropped=0, denied=0)
+        self._server = None
+        self._sub = None
+        self._task = None
+        self._closing = None
+
+    # ------------------------------ requests ------------------------------
+
+    def request(self, client, kind, msg):
+        if kind == CMD:
+            cmd = msg[1]
+            if msg[0] != HOST_TO_GW or cmd not in othost.commands:
+                client.error(cmd, INVALID)
+            elif cmd == EOS or (cmd not in read_only and client is not self.owner):
+                self.stats["denied"] += 1
+                client.error(cmd, DENIED)
+            elif client.pending >= MAX_PENDING:
+                client.error(cmd, BUSY)
+            else:
+                client.pending += 1
+                asyncio.ensure_future(self._command(client, cmd, msg[2], msg[3]))
+        elif kind == INJECT:
+            if client is not self.owner:
+                self.stats["denied"] += 1
+                client.error(0, DENIED, INJECT)
+            else:
+                self.engine.send(msg)
+        elif kind == ACQUIRE:
+            if self.owner is None:
+                self.owner = client
+            if self.owner is client:
+                client.send(CONTROL, b"\x01\0\0\0")
+            else:
+                self.stats["denied"] += 1
+                client.error(0, DENIED, ACQUIRE)
+        elif kind == RELEASE:
+            if self.owner is client:
+                self.owner = None
+            client.send(CONTROL, b"\0\0\0\0")
+        else:
+            client.error(0, INVALID, kind)
+
+    async def _command(self, client, cmd, msb, lsb):
+        try:
+            rmsb, rlsb = await self.engine.command(cmd, msb, lsb)
+        except GWIOException:
+            client.error(cmd, FAILED)
+            return
+        finally:
+            client.pending -= 1
+        if cmd in (DO_MONITOR, DO_INTERCEPT):
+            self.engine.mode = cmd  # also after a new handshake
+        client.send(REPLY, (HOST_TO_GW, cmd, rmsb, rlsb))
+
+    def remove(self, client):
+        self.clients.discard(client)
+        if self.owner is client:
+            self.owner = None
+
+    # ------------------------------ broadcast ------------------------------
+
+    async def _broadcast(self):
+        while True:
+            items = await self._sub.get_batch()
+            buf = b"".join(OUT.pack(FRAME, ns(ts), msg) for ts, msg in items)
+            for client in list(self.clients):
+                if not client.paused:
+                    client.transport.write(buf)
+                else:
+                    client.dropped += len(items)
+                    self.stats["dropped"] += len(items)
+
+    # ------------------------------ lifecycle ------------------------------
+
+    def _unlink_stale(self):
+        """Remove a socket file left behind by a daemon that died."""
+        if not os.path.exists(self.path):
+            return
+        s = socket.socket(socket.AF_UNIX)
+        try:
+            s.connect(self.path)
+        except (ConnectionRefusedError, FileNotFoundError):
+            os.unlink(self.path)
+        else:
+            raise GWIOException("%s is in use by another daemon." % self.path)
+        finally:
+            s.close()
+
+    async def start(self):
+        self._unlink_stale()
+        loop = asyncio.get_running_loop()
+        self._server = await loop.create_unix_server(lambda: ClientProtocol(self), self.path)
+        self._sub = self.engine.subscribe(QUEUE_SIZE)
+        self._task = asyncio.ensure_future(self._broadcast())
+        await self.engine.start()
+
+    async def close(self):
+        """Stop serving and close the engine, True if the gateway
+        confirmed EOS. May be called more than once, from the signal
+        handler and at the end of serve()."""
+        if self._closing is None:
+            self._closing = asyncio.ensure_future(self._close())
+        return await asyncio.shield(self._closing)
+
+    async def _close(self):
+        if self._server:
+            self._server.close()
+            self._server = None
+            try:
+                os.unlink(self.path)
+            except FileNotFoundError:
+                pass
+        for client in list(self.clients):
+            client.transport.close()
+        if self._task:
+            self._task.cancel()
+        return await self.engine.close()
+
+    async def run(self):
+        await self.start()
+        await self.engine.done
+
+
+class Client(object):
+    """Client side of the socket, for programs that use the daemon.
+
+      client = await Client.connect("/run/otgw.sock")
+      print(await client.command(othost.GET_T_MIN))
+      async for ts, msg in client.frames():
+          ...
+    """
+
+    def __init__(self, reader, writer, maxsize=QUEUE_SIZE):
+        self._reader = reader
+        self._writer = writer
+        self._frames = deque(maxlen=maxsize)
+        self._event = asyncio.Event()
+        self._waiting = deque()     # ((kind, cmd), future), cmd 0 for ACQUIRE / RELEASE
+        self._task = asyncio.ensure_future(self._read())
+        self.closed = False
+
+    @classmethod
+    async def connect(cls, path=SOCKET, maxsize=QUEUE_SIZE):
+        reader, writer = await asyncio.open_unix_connection(path)
+        return cls(reader, writer, maxsize)
+
+    async def _read(self):
+        try:
+            while True:
+                kind, ts, msg = OUT.unpack(await self._reader.readexactly(OUT.size))
+                if kind == FRAME:
+                    self._frames.append((ts / 1e9, msg))
+                    self._event.set()
+                else:
+                    self._resolve(kind, msg)
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            self.closed = True
+            self._event.set()
+            while self._waiting:
+                _, fut = self._waiting.popleft()
+                if not fut.done():
+                    fut.set_exception(GWIOException("Daemon closed the connection."))
+
+    def _resolve(self, kind, msg):
+        if kind == REPLY:
+            key = (CMD, msg[1])
+        elif kind == ERROR:
+            key = (msg[3], msg[1])
+        else:
+            key = None      # CONTROL, the answer to ACQUIRE or RELEASE
+        for entry in self._waiting:
+            if entry[0] == key or (key is None and entry[0][0] in (ACQUIRE, RELEASE)):
+                self._waiting.remove(entry)
+                fut = entry[1]
+                if fut.done():
+                    pass
+                elif kind == ERROR:
+                    fut.set_exception(GWIOException("Request 0x%02x refused, reason %i." % (msg[1], msg[2])))
+                else:
+                    fut.set_result(msg)
+                return
+
+    async def _request(self, kind, msg, key):
+        fut = asyncio.get_running_loop().create_future()
+        self._waiting.append((key, fut))
+        self._writer.write(IN.pack(kind, bytes(msg)))
+        return await fut
+
+    async def frames(self):
+        """Frames from the bus until the daemon goes away."""
+        while True:
+            while self._frames:
+                yield self._frames.popleft()
+            if self.closed:
+                return
+            self._event.clear()
+            await self._event.wait()
+
+    async def command(self, cmd, msb=0, lsb=0):
+        msg = await self._request(CMD, (HOST_TO_GW, cmd, msb, lsb), (CMD, cmd))
+        return msg[2], msg[3]
+
+    async def get_value(self, cmd):
+        msb, lsb = await self.command(cmd)
+        return (msb << 8) + lsb
+
+    async def set_value(self, cmd, v):
+        msb, lsb = await self.command(cmd, (v >> 8) & 0xFF, v & 0xFF)
+        return (msb << 8) + lsb
+
+    async def acquire(self):
+        await self._request(ACQUIRE, b"\0\0\0\0", (ACQUIRE, 0))
+
+    async def release(self):
+        await self._request(RELEASE, b"\0\0\0\0", (RELEASE, 0))
+
+    def inject(self, msg):
+        self._writer.write(IN.pack(INJECT, bytes(msg)))
+
+    async def close(self):
+        """Half close and wait until the daemon has let go of us."""
+        if not self.closed:
+            self._writer.write_eof()
+            await self._task
+        self._writer.close()
+
+
+async def serve(args):
+    clock = time.time
+    if args.replay:
+        ser = otcapture.ReplaySerial(otcapture.Capture(args.replay), args.speed)
+        clock = ser.clock
+    else:
+        import serial
+        ser = serial.Serial(args.port, 115200, timeout=0)
+    mode = DO_INTERCEPT if args.mode == "intercept" else DO_MONITOR
+    import otengine
+    engine = otengine.Engine(ser, mode, clock=clock, setup=[othost.set_windows])
+    daemon = Daemon(engine, args.socket)
+    loop = asyncio.get_running_loop()
+    for sig in (signal.SIGINT, signal.SIGTERM):
+        loop.add_signal_handler(sig, lambda: asyncio.ensure_future(daemon.close()))
+    try:
+        await daemon.run()
+    except otcapture.ReplayDone:
+        pass
+    finally:
+        ok = await daemon.close()
+        ser.close()
+        s = daemon.stats
+        print("clients %i, slow clients dropped %i, frames dropped %i, requests denied %i" %
+              (s["clients"], s["slow"], s["dropped"], s["denied"]), file=sys.stderr)
+        if ok:
+            print("Clean termination.")
+
+
+async def monitor(args):
+    client = await Client.connect(args.socket)
+    async for ts, msg in client.frames():
+        othost.print_frame(ts, msg)
+
+
+def parse_cmd(name):
+    try:
+        return int(name, 0)
+    except ValueError:
+        return getattr(othost, name.upper())
+
+
+async def command(args):
+    client = await Client.connect(args.socket)
+    cmd = parse_cmd(args.cmd)
+    if args.value is not None:
+        await client.acquire()
+        v = await client.set_value(cmd, args.value)
+    else:
+        v = await client.get_value(cmd)
+    print(v)
+    await client.close()
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Share an OpenTherm gateway over a Unix socket.")
+    common = argparse.ArgumentParser(add_help=False)
+    common.add_argument("--socket", default=SOCKET, help="Path of the Unix socket.")
+    sub = parser.add_subparsers(dest="action", required=True)
+    p = sub.add_parser("serve", parents=[common], help="Own the gateway and serve clients.")
+    p.add_argument("mode", nargs="?", default="monitor", choices=("monitor", "intercept"))
+    p.add_argument("--port", default="/dev/ttyAMA0", help="Serial port of the gateway.")
+    p.add_argument("--replay", metavar="FILE", help="Replay a capture instead of using the gateway.")
+    p.add_argument("--speed", type=float, default=1.0, help="Replay speed.")
+    p = sub.add_parser("monitor", parents=[common], help="Print the frames from the bus.")
+    p = sub.add_parser("command", parents=[common], help="Send one command, print the value of the reply.")
+    p.add_argument("cmd", help="Command name (GET_T_MIN) or number.")
+    p.add_argument("value", nargs="?", type=int, help="Value for a SET_ command, takes control.")
+    args = parser.parse_args()
+    try:
+        asyncio.run(globals()[args.action](args))
+    except KeyboardInterrupt:
+        pass
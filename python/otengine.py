@@ -0,0 +1,493 @@
+#!/usr/bin/env python3
+"""asyncio engine for one OpenTherm gateway.
+
+The engine owns the serial port. A reader registered with the event
+loop takes whatever the port has, runs the handshake (ENQ / SYN / ACK)
+and feeds the rest to the FrameParser from othost.py. Frames are then
+published to subscribers; command replies, credits and overrun reports
+are handled by the engine itself.
+
+  engine = Engine(serial.Serial("/dev/ttyAMA0", 115200, timeout=0))
+  sub = engine.subscribe()
+  await engine.start()
+  async for ts, msg in sub:
+      ...
+
+Every subscriber has its own bounded queue. When a consumer falls
+behind, its oldest frames are dropped and counted in dropped; frame
+ingestion never waits for a consumer. Commands go through a queue that
+is only sent while the gateway has credits (see firmware/protocol.h)
+and return a future per command. When a credit or reply does not come
+back in time, a SYN frame gets all credits back. An UNKNOWN_CMD reply
+names the command it belongs to and fails that command at once. A
+keep-alive PING is sent whenever nothing was sent to the gateway for
+KEEPALIVE seconds, independent of traffic on the bus, so the gateway
+watchdog (8 s) does not fire.
+
+Sources without a file descriptor, like otcapture.ReplaySerial, are
+read in a worker thread and go through the same feed() path.
+"""
+
+import asyncio
+import inspect
+import os
+import time
+from collections import deque
+
+import otcapture
+from othost import (ENQ, SYN, SYN_FRAME, ACK, MSGID_MSK, HOST_TO_GW, PING, EOS, DO_MONITOR,
+                    CREDIT, OVERRUN, UNKNOWN_CMD, FRAME_BYTES, READ_CHUNK, RX_WINDOW,
+                    CREDIT_TIMEOUT, FrameParser, GWIOException, UnknownCommand)
+
+KEEPALIVE = 6.0         # s, the gateway watchdog fires after 8 s
+CMD_TIMEOUT = 2.0       # s
+ACK_TIMEOUT = 1.0       # s, send SYN again after this
+QUEUE_SIZE = 1024       # frames per subscriber
+
+# Session states
+WAIT_ENQ = 0
+WAIT_ACK = 1
+SETUP = 2               # handshake done, setup hooks and mode command
+RUNNING = 3
+CLOSED = 4
+
+
+class Subscription(object):
+    """Bounded queue of (timestamp, frame) for one consumer. Frames are
+    shared bytes objects, not copies."""
+
+    def __init__(self, engine, maxsize, match):
+        self._engine = engine
+        self._q = deque()
+        self._event = asyncio.Event()
+        self.maxsize = maxsize
+        self.match = match
+        self.dropped = 0
+
+    def _put(self, item):
+        if len(self._q) >= self.maxsize:
+            self._q.popleft()
+            self.dropped += 1
+        self._q.append(item)
+        self._event.set()
+
+    def __len__(self):
+        return len(self._q)
+
+    async def get(self):
+        while not self._q:
+            self._event.clear()
+            await self._event.wait()
+        return self._q.popleft()
+
+    async def get_batch(self):
+        """All queued frames, waits for at least one."""
+        while not self._q:
+            self._event.clear()
+            await self._event.wait()
+        items = list(self._q)
+        self._q.clear()
+        return items
+
+    def drain(self):
+        """All queued frames, without waiting."""
+        items = list(self._q)
+        self._q.clear()
+        return items
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        return await self.get()
+
+    def close(self):
+        self._engine.unsubscribe(self)
+
+
+class Engine(object):
+
+    def __init__(self, ser, mode=DO_MONITOR, recorder=None, clock=time.time,
+                 setup=(), keepalive=KEEPALIVE, name=None):
+        self.name = name
+        self.mode = mode
+        self.clock = clock
+        self.keepalive = keepalive
+        self.setup = list(setup)    # coroutine functions, called with the engine
+        self.state = WAIT_ENQ
+        self.parser = FrameParser()
+        self.credits = RX_WINDOW
+        self.stats = dict(frames=0, sent=0, commands=0, timeouts=0, unknown=0, overruns=0,
+                          sessions=0, lost_sessions=0, syn_frames=0, rx_bytes=0)
+        self._ser = ser
+        self._recorder = recorder
+        self._subs = []
+        self._out = deque()         # (frame, future of a command or None) waiting for a credit
+        self._waiting = deque()     # (cmd, future) for command replies
+        self._resync = False
+        self._session = None        # Event, set while a session is up
+        self._tasks = []
+        self._fd = None
+        self._loop = None
+        self._last_tx = 0
+        self._ack_deadline = 0
+        self._credit_timer = None   # SYN frame when no credit comes back
+        self._closing = None
+        self.done = None            # Future, finished when the engine stops
+
+    # ------------------------------ consumers ------------------------------
+
+    def subscribe(self, maxsize=QUEUE_SIZE, match=None):
+        """New subscription to all frames from the bus, or only frames
+        for which match(frame) is true."""
+        sub = Subscription(self, maxsize, match)
+        self._subs.append(sub)
+        return sub
+
+    def unsubscribe(self, sub):
+        if sub in self._subs:
+            self._subs.remove(sub)
+
+    def consume(self, callback, maxsize=QUEUE_SIZE, match=None):
+        """Run callback(ts, frame), a function or coroutine function,
+        for every frame in a task of its own."""
+        sub = self.subscribe(maxsize, match)
+        is_coro = inspect.iscoroutinefunction(callback)
+
+        async def run():
+            try:
+                while True:
+                    for ts, msg in await sub.get_batch():
+                        if is_coro:
+                            await callback(ts, msg)
+                        else:
+                            callback(ts, msg)
+            finally:
+                sub.close()
+
+        task = asyncio.ensure_future(run())
+        self._tasks.append(task)
+        return sub
+
+    def _publish(self, ts, msg):
+        item = (ts, msg)
+        for sub in self._subs:
+            if sub.match is None or sub.match(msg):
+                sub._put(item)
+
+    # ------------------------------ commands ------------------------------
+
+    async def command(self, cmd, msb=0, lsb=0, timeout=CMD_TIMEOUT):
+        """Send a command to the gateway, return (msb, lsb) of the reply.
+        The timeout includes waiting for a session and for a credit; a
+        command that was not sent by then is dropped."""
+        if self.state == CLOSED:
+            raise GWIOException("Engine closed.")
+        entry = (cmd, self._loop.create_future())
+        try:
+            return await asyncio.wait_for(self._command(entry, msb, lsb), timeout)
+        except asyncio.TimeoutError:
+            self.stats["timeouts"] += 1
+            if not self._session.is_set():
+                raise GWIOException("No session for command 0x%02x." % cmd)
+            self._unqueue(entry[1])
+            if self.state in (SETUP, RUNNING):
+                self._send_syn_frame()  # the reply, and its credit, may be lost
+            raise GWIOException("No reply to command 0x%02x." % cmd)
+        finally:
+            if entry in self._waiting:
+                self._waiting.remove(entry)
+
+    async def _command(self, entry, msb, lsb):
+        await self._session.wait()
+        self._waiting.append(entry)
+        self._queue(bytes([HOST_TO_GW, entry[0], msb, lsb]), entry[1])
+        self.stats["commands"] += 1
+        return await entry[1]
+
+    async def get_value(self, cmd):
+        msb, lsb = await self.command(cmd)
+        return (msb << 8) + lsb
+
+    async def set_value(self, cmd, v):
+        msb, lsb = await self.command(cmd, (v >> 8) & 0xFF, v & 0xFF)
+        return (msb << 8) + lsb
+
+    def send(self, msg):
+        """Queue an OpenTherm frame for the thermostat or boiler. The
+        gateway adds the parity bit itself."""
+        msg = bytearray(msg)
+        msg[0] &= 0x7F
+        self._queue(bytes(msg))
+
+    def _queue(self, msg, fut=None):
+        self._out.append((msg, fut))
+        self._pump()
+
+    def _unqueue(self, fut):
+        """Drop the frame of a command that was not sent yet."""
+        for item in self._out:
+            if item[1] is fut:
+                self._out.remove(item)
+                return
+
+    def _pump(self):
+        while self._out and self.credits > 0 and self.state in (SETUP, RUNNING):
+            msg, _ = self._out.popleft()
+            self.credits -= 1
+            self._write(msg)
+            self._record(otcapture.HOST_TO_GW, msg)
+            self.stats["sent"] += 1
+            self._last_tx = self._loop.time()
+        if self._out and self.credits == 0 and self._credit_timer is None:
+            self._credit_timer = self._loop.call_later(CREDIT_TIMEOUT, self._credit_timeout)
+
+    def _credit_timeout(self):
+        """Frames waited CREDIT_TIMEOUT for a credit: one got lost, e.g.
+        a CREDIT frame the FrameParser dropped while it resynced."""
+        self._credit_timer = None
+        if self._out and self.credits == 0 and self.state in (SETUP, RUNNING):
+            self._send_syn_frame()
+
+    def _send_syn_frame(self):
+        """Ask the gateway for all credits again. It answers a SYN frame
+        in any state with CREDIT, SYN, RX_WINDOW; credits before that
+        do not count (see firmware/protocol.h)."""
+        self.credits = 0
+        self._resync = True
+        self.stats["syn_frames"] += 1
+        self._write(SYN_FRAME)
+        for _ in SYN_FRAME:
+            self._record(otcapture.HOST_TO_GW, SYN, otcapture.BYTE)
+        self._last_tx = self._loop.time()
+        self._pump()    # again after CREDIT_TIMEOUT if that gets lost too
+
+    def _fail_waiting(self, reason, sent_only=False):
+        """Fail the commands waiting for a reply; with sent_only the
+        ones still in _out stay, they are sent after the resync."""
+        queued = set(fut for _, fut in self._out if fut) if sent_only else ()
+        for entry in list(self._waiting):
+            if entry[1] not in queued:
+                self._waiting.remove(entry)
+                if not entry[1].done():
+                    entry[1].set_exception(GWIOException(reason))
+
+    # ------------------------------ input ------------------------------
+
+    def feed(self, data):
+        """Process bytes read from the gateway."""
+        self.stats["rx_bytes"] += len(data)
+        if self.state in (WAIT_ENQ, WAIT_ACK):
+            data = self._handshake(data)
+            if not data:
+                return
+        now = self.clock()
+        enq = self.parser.enq
+        frames = self.parser.feed(data)
+        for msg in frames:
+            self._dispatch(now, bytes(msg))
+        if self.parser.enq != enq and not frames:
+            self._lost_session()
+
+    def _handshake(self, data):
+        for k, c in enumerate(data):
+            if c == ENQ:
+                self._record(otcapture.GW_TO_HOST, c, otcapture.BYTE)
+                if self.state == WAIT_ENQ or self._loop.time() > self._ack_deadline:
+                    self._write(bytes([SYN]))
+                    self._record(otcapture.HOST_TO_GW, SYN, otcapture.BYTE)
+                    self.state = WAIT_ACK
+                    self._ack_deadline = self._loop.time() + ACK_TIMEOUT
+            elif c == ACK and self.state == WAIT_ACK:
+                self._record(otcapture.GW_TO_HOST, c, otcapture.BYTE)
+                self._start_session()
+                return data[k + 1:]
+        return b""
+
+    def _start_session(self):
+        self.state = SETUP
+        self.parser.reset()
+        self.credits = RX_WINDOW
+        self._resync = False
+        self._last_tx = self._loop.time()
+        self.stats["sessions"] += 1
+        self._session.set()
+        self._tasks.append(asyncio.ensure_future(self._run_setup()))
+
+    async def _run_setup(self):
+        try:
+            for hook in self.setup:
+                await hook(self)
+            await self.command(self.mode)
+        except GWIOException:
+            return  # lost again, the next handshake starts over
+        if self.state == SETUP:
+            self.state = RUNNING
+
+    def _lost_session(self):
+        """The watchdog has put the gateway back in PASSTHRU mode."""
+        self.stats["lost_sessions"] += 1
+        self.state = WAIT_ENQ
+        self.parser.reset()
+        self._session.clear()
+        self._out.clear()
+        self._fail_waiting("Gateway is back in PASSTHRU mode.")
+
+    def _dispatch(self, ts, msg):
+        self._record(otcapture.GW_TO_HOST, msg)
+        if (msg[0] & MSGID_MSK) != HOST_TO_GW:
+            self.stats["frames"] += 1
+            self._publish(ts, msg)
+            return
+        cmd = msg[1]
+        if cmd == OVERRUN:
+            # Frames in flight are lost, see Session._fill() in othost.py.
+            self.stats["overruns"] += 1
+            self._send_syn_frame()
+            self._fail_waiting("Command lost in gateway overrun.", sent_only=True)
+            return
+        if cmd == CREDIT and msg[2] == SYN:
+            self.credits = msg[3]
+            self._resync = False
+        elif not self._resync:
+            self.credits = min(self.credits + 1, RX_WINDOW)
+        if self.credits and self._credit_timer:
+            self._credit_timer.cancel()
+            self._credit_timer = None
+        if cmd == UNKNOWN_CMD:
+            self.stats["unknown"] += 1
+            for entry in self._waiting:
+                if entry[0] == msg[2]:
+                    self._waiting.remove(entry)
+                    if not entry[1].done():
+                        entry[1].set_exception(UnknownCommand("Gateway does not know command 0x%02x." % msg[2]))
+                    break
+        elif cmd != CREDIT:
+            for entry in self._waiting:
+                if entry[0] == cmd:
+                    self._waiting.remove(entry)
+                    if not entry[1].done():
+                        entry[1].set_result((msg[2], msg[3]))
+                    break
+        self._pump()
+
+    # ------------------------------ I/O ------------------------------
+
+    def _record(self, direction, msg, kind=otcapture.FRAME):
+        if self._recorder:
+            self._recorder.record(direction, msg, kind)
+
+    def _write(self, data):
+        try:
+            self._ser.write(data)
+        except Exception as e:
+            self._stop(e)
+
+    def _on_readable(self):
+        try:
+            data = os.read(self._fd, READ_CHUNK)
+        except BlockingIOError:
+            return
+        except OSError as e:
+            self._stop(e)
+            return
+        if not data:
+            self._stop(EOFError("Gateway closed the connection."))
+            return
+        self.feed(data)
+
+    async def _pull(self):
+        """Read loop for sources without a file descriptor."""
+        try:
+            while True:
+                n = min(max(self._ser.in_waiting, FRAME_BYTES), READ_CHUNK)
+                data = await self._loop.run_in_executor(None, self._ser.read, n)
+                if data:
+                    self.feed(bytearray(data))
+        except asyncio.CancelledError:
+            raise
+        except Exception as e:
+            self._stop(e)
+
+    async def _keep_alive(self):
+        while True:
+            await asyncio.sleep(max(0.1, self._last_tx + self.keepalive - self._loop.time()))
+            if self.state == RUNNING and self._loop.time() - self._last_tx >= self.keepalive:
+                self._last_tx = self._loop.time()
+                try:
+                    await self.command(PING)
+                except GWIOException:
+                    pass
+
+    def _fileno(self):
+        try:
+            fd = self._ser.fileno()
+        except (AttributeError, OSError, ValueError):
+            return None
+        return fd if isinstance(fd, int) else None
+
+    async def start(self):
+        self._loop = asyncio.get_running_loop()
+        self._session = asyncio.Event()
+        self.done = self._loop.create_future()
+        self._fd = self._fileno()
+        if self._fd is not None:
+            os.set_blocking(self._fd, False)
+            self._loop.add_reader(self._fd, self._on_readable)
+        else:
+            self._tasks.append(asyncio.ensure_future(self._pull()))
+        self._tasks.append(asyncio.ensure_future(self._keep_alive()))
+
+    def _stop(self, exc=None):
+        if self.state == CLOSED:
+            return
+        self.state = CLOSED
+        if self._credit_timer:
+            self._credit_timer.cancel()
+        if self._fd is not None:
+            self._loop.remove_reader(self._fd)
+        for task in self._tasks:
+            task.cancel()
+        self._session.clear()
+        self._fail_waiting("Engine closed.")
+        if not self.done.done():
+            if exc is None:
+                self.done.set_result(None)
+            else:
+                self.done.set_exception(exc)
+
+    async def close(self):
+        """End the session with EOS, so the gateway goes back to
+        PASSTHRU right away, and stop. True if the gateway confirmed.
+        May be called more than once."""
+        if self._closing is None:
+            self._closing = asyncio.ensure_future(self._close())
+        return await asyncio.shield(self._closing)
+
+    async def _close(self):
+        ok = False
+        if self.state == RUNNING:
+            try:
+                await self.command(EOS, timeout=0.5)
+                ok = True
+            except GWIOException:
+                pass
+        self._stop()
+        return ok
+
+    async def run(self):
+        """Start and wait until the engine stops."""
+        await self.start()
+        await self.done
+
+    def dropped(self):
+        return sum(sub.dropped for sub in self._subs)
+
+    def metrics(self):
+        """Counters of this gateway, for reporting."""
+        m = dict(self.stats)
+        m.update(state=("WAIT_ENQ", "WAIT_ACK", "SETUP", "RUNNING", "CLOSED")[self.state],
+                 credits=self.credits, queued=len(self._out), dropped=self.dropped(),
+                 resyncs=self.parser.resyncs, skipped=self.parser.dropped,
+                 suspect=self.parser.suspect)
+        return m
@@ -1,10 +1,17 @@
-#!/usr/bin/env python
+#!/usr/bin/env python3
 
+import asyncio
+import os
 import serial
+import signal
 import sys
 import argparse
+from collections import deque
 from datetime import datetime
-from time import sleep, time
+from time import time
+
+import otcapture
+import otcodec
 
 ENQ = 0x05
 SYN = 0x16
@@ -55,7 +62,38 @@ GET_SYN_ERR_CNT = 0x12
 SET_SYN_ERR_CNT = 0x92
 GET_TEST = 0x13
 SET_TEST = 0x93
+GET_T_GLITCH = 0x14
+SET_T_GLITCH = 0x94
+GET_GLITCH_CNT = 0x15
+SET_GLITCH_CNT = 0x95
+CREDIT = 0x17
+OVERRUN = 0x18
+GET_OVERRUN_CNT = 0x19
+SET_OVERRUN_CNT = 0x99
+GET_BENCH = 0x1A   # firmware built with -DBENCH, see otbench.py
+GET_SAVED_CNT = 0x1B
+SET_SAVED_CNT = 0x9B
 DO_TEST = 0xFF
+UNKNOWN_CMD = 0x70  # in the reply to an unknown command, msg[2] is the command
+
+commands = frozenset([
+    EOS, PING, RESTART, DO_MONITOR, DO_INTERCEPT, GET_TEMPR,
+    GET_T_DIV, SET_T_DIV, GET_T, SET_T, GET_T2, SET_T2,
+    GET_T_MIN, SET_T_MIN, GET_T_MAX, SET_T_MAX, GET_T2_MIN, SET_T2_MIN,
+    GET_T2_MAX, SET_T2_MAX, GET_LED, SET_LED, GET_BAUD, SET_BAUD,
+    GET_PAR_ERR_CNT, SET_PAR_ERR_CNT, GET_FRM_ERR_CNT, SET_FRM_ERR_CNT,
+    GET_SYN_ERR_CNT, SET_SYN_ERR_CNT, GET_TEST, SET_TEST,
+    GET_T_GLITCH, SET_T_GLITCH, GET_GLITCH_CNT, SET_GLITCH_CNT,
+    GET_SAVED_CNT, SET_SAVED_CNT, CREDIT, OVERRUN, GET_OVERRUN_CNT,
+    SET_OVERRUN_CNT, GET_BENCH, DO_TEST, UNKNOWN_CMD])
+
+FRAME_BYTES = 4
+SYN_FRAME = bytes([SYN] * FRAME_BYTES)    # all credits back, see protocol.h
+SYNC_FRAMES = 4     # frames per offset compared before alignment is trusted again
+MAX_SYNC_FRAMES = 16    # wait at most this long when several offsets fit
+READ_CHUNK = 4096
+RX_WINDOW = 2       # frames that fit in cb_in of the gateway
+CREDIT_TIMEOUT = 2.0    # s without a credit or reply, then a SYN frame
 
 MASTER_TO_SLAVE = 0
 SLAVE_TO_MASTER = 1
@@ -142,58 +180,180 @@ data_id = {
     128: ("SmartPower", "Smart power level change.")
  }
 
-session = None
-
-def get_bit(int_type, offset):
-    """testBit() returns a nonzero result, 2**offset, if the bit at
-    'offset' is one."""
-    mask = 1 << offset
-    return(int_type & mask)
-
-def set_bit(int_type, offset):
-    """setBit() returns an integer with the bit at 'offset' set to
-    1."""
-    mask = 1 << offset
-    return(int_type | mask)
-
-def clear_bit(int_type, offset):
-    """clearBit() returns an integer with the bit at 'offset'
-    cleared."""
-    mask = ~(1 << offset)
-    return(int_type & mask)
-
-def toggle_bit(int_type, offset):
-    """toggleBit() returns an integer with the bit at 'offset'
-    inverted, 0 -> 1 and 1 -> 0."""
-    mask = 1 << offset
-    return(int_type ^ mask)
-
-def bin(s):
-    """Integer to Bin String"""
-    return str(s) if s <= 1 else bin(s >> 1) + str(s & 1)
-
-def process_msg_type(b):
-    if b & 0xf:
-        print "msg[0] =", b
-        #raise ProtocolException("Spare bits are not 0.")
-    if get_bit(b, 6):
-        msg_type = SLAVE_TO_MASTER
-    else:
-        msg_type = MASTER_TO_SLAVE
-    return (msg_type, ((b & 0x70) >> 4))
+# Parity of a byte, a frame has even parity when the xor of its bytes does.
+_parity = bytes(format(i, "b").count("1") & 1 for i in range(256))
+
+def valid_frame(buf, pos=0):
+    """Could buf[pos:pos + 4] be a frame from the gateway? OpenTherm
+    frames keep the parity bit they were received with, so the 32 bits
+    have even parity, and the spare bits are 0. Frames of the gateway
+    itself are HOST_TO_GW without parity bit and carry a known command.
+    Msg-type 3 does not exist on the bus."""
+    b = buf[pos]
+    if b & 0x0F:
+        return False
+    if (b & MSGID_MSK) == HOST_TO_GW:
+        return b == HOST_TO_GW and buf[pos + 1] in commands
+    return not _parity[b ^ buf[pos + 1] ^ buf[pos + 2] ^ buf[pos + 3]]
+
+def _request(b):
+    """Is b the first byte of a request, READ_DATA to INVALID_DATA?"""
+    return (b & MSGID_MSK) < HOST_TO_GW
+
+def _score(buf, pos, count):
+    """How likely count frames from pos are aligned: -1 when one is not
+    valid, otherwise the number of HOST_TO_GW frames and of requests
+    directly followed by a reply with the same DataID. A frame with
+    zeros moved in from the next one is usually still valid, but it is
+    a request more often than not and rarely answered."""
+    score = 0
+    prev = None
+    for p in range(pos, pos + count * FRAME_BYTES, FRAME_BYTES):
+        if not valid_frame(buf, p):
+            return -1
+        b = buf[p] & MSGID_MSK
+        if b == HOST_TO_GW:
+            score += 1
+        elif b > HOST_TO_GW and prev is not None and _request(buf[prev]) and buf[prev + 1] == buf[p + 1]:
+            score += 1
+        prev = p
+    return score
+
+class FrameParser(object):
+    """Splits the byte stream from the gateway into frames. When a frame
+    fails valid_frame() alignment is lost, e.g. after a dropped byte.
+    Then the four offsets are compared over sync_frames frames and the
+    only one with all frames valid wins. When more fit, the one with the
+    most HOST_TO_GW frames and answered requests does; on a tie the
+    window is doubled up to MAX_SYNC_FRAMES before the first offset is
+    taken. The first frame at a new offset is usually made of bytes from
+    both sides of the gap and is dropped as well. Frames full of zeros
+    are often still valid a byte or two off, so two requests in a row,
+    which hardly happens when aligned, have the offsets compared too.
+    Bytes that cannot start a frame are
+    skipped one by one; ENQ bytes among them mean the watchdog has put
+    the gateway back in PASSTHRU mode. A lost byte usually leaves the
+    frame it was in valid, so a frame followed by an invalid one in the
+    same read is dropped too."""
+
+    def __init__(self, sync_frames=SYNC_FRAMES):
+        self._buf = bytearray()
+        self.sync_frames = sync_frames
+        self.aligned = True
+        self._checked = False   # next frame is at an offset just compared
+        self._lost = False      # an invalid frame started the comparison
+        self._last = HOST_TO_GW # first byte of the last frame
+        self.frames = 0
+        self.resyncs = 0    # times alignment was lost
+        self.dropped = 0    # bytes skipped while resynchronizing
+        self.suspect = 0    # frames dropped because the next one was invalid
+        self.enq = 0        # ENQ bytes skipped
+
+    def reset(self):
+        del self._buf[:]
+        self.aligned = True
+        self._checked = False
+        self._lost = False
+        self._last = HOST_TO_GW
+
+    def _offset(self, buf, pos, n):
+        """Offset from pos where the frames start, None when more bytes
+        are needed and -1 when no offset fits."""
+        count = self.sync_frames
+        while True:
+            if pos + FRAME_BYTES - 1 + count * FRAME_BYTES > n:
+                return None
+            scores = [_score(buf, pos + o, count) for o in range(FRAME_BYTES)]
+            best = max(scores)
+            if best < 0:
+                return -1
+            if scores.count(best) == 1 or count >= MAX_SYNC_FRAMES:
+                return scores.index(best)
+            count *= 2
+
+    def _skip(self, buf, pos, k):
+        self.enq += buf.count(ENQ, pos, pos + k)
+        self.dropped += k
+
+    def feed(self, data):
+        """Add bytes read from the gateway, return the list of frames
+        that are complete now."""
+        buf = self._buf
+        buf += data
+        n = len(buf)
+        frames = []
+        pos = 0
+        while True:
+            avail = n - pos
+            if self.aligned:
+                if avail < FRAME_BYTES:
+                    break
+                if valid_frame(buf, pos):
+                    ahead = avail >= 2 * FRAME_BYTES
+                    if not ahead or valid_frame(buf, pos + FRAME_BYTES):
+                        b = buf[pos]
+                        if self._checked or not _request(b) or not (
+                                _request(self._last) or ahead and _request(buf[pos + FRAME_BYTES])):
+                            frames.append(buf[pos:pos + FRAME_BYTES])
+                            self._last = b
+                            self._checked = False
+                            pos += FRAME_BYTES
+                            continue
+                        self.aligned = False
+                        self._lost = False
+                        continue
+                    self.suspect += 1
+                self.aligned = False
+                self._lost = True
+                self.resyncs += 1
+            if avail == 0:
+                break
+            if buf[pos] & 0x0F:
+                self._skip(buf, pos, 1)
+                pos += 1
+                continue
+            offset = self._offset(buf, pos, n)
+            if offset is None:
+                break
+            if offset < 0:
+                self._skip(buf, pos, 1)
+                pos += 1
+                continue
+            if offset:
+                if not self._lost:
+                    self.resyncs += 1
+                offset += FRAME_BYTES
+            self._skip(buf, pos, offset)
+            pos += offset
+            self.aligned = True
+            self._checked = True
+        del buf[:pos]
+        self.frames += len(frames)
+        return frames
+
+def _in_waiting(ser):
+    try:
+        return ser.in_waiting
+    except AttributeError:
+        return ser.inWaiting()
+
+# Lookup tables for printing, indexed by msg-type and DataID.
+_repr_type = tuple("%s\t%s" % (direction[t >> 2], msg_type[t]) for t in range(8))
+_repr_id = tuple(data_id[i][0] if i in data_id else "<unknown>" for i in range(256))
 
 def repr_msg(msg):
-    d, v = process_msg_type(msg[0])
-#    return str(msg).encode("hex")
-#    print "%s\t%s\t%s" % (d, v, str(msg).encode("hex"))
-    return "%s\t%s" % (direction[d], msg_type[v])
+    return _repr_type[(msg[0] >> 4) & 0x07]
 
 def repr_data_id(msg):
-    try:
-        mnem, descr = data_id[msg[1]]
-    except:
-        mnem, descr = "<unknown>", "<unknown>"
-    return "%s" % mnem
+    return _repr_id[msg[1]]
+
+def format_frames(items):
+    """Lines for a batch of (timestamp, frame), the values decoded by
+    otcodec in one call."""
+    b = otcodec.decode(b"".join(msg for ts, msg in items))
+    return ["%s\t%s\t%s" % (_repr_type[b.type[k]], _repr_id[b.data_id[k]],
+                            otcodec.text(b.data_id[k], b.raw[k], b.value[k], b.lb[k]))
+            for k in range(len(b))]
 
 class GWIOException(Exception):
     def __init__(self, value):
@@ -201,6 +361,10 @@ class GWIOException(Exception):
     def __str__(self):
         return repr(self.value)
 
+class UnknownCommand(GWIOException):
+    """The gateway answered a command with UNKNOWN_CMD, e.g. GET_BENCH
+    to firmware built without -DBENCH."""
+
 class UnknownDataID(Exception):
     def __init__(self, value):
         self.value = value
@@ -214,42 +378,152 @@ class ProtocolException(Exception):
         return repr(self.value)
 
 class Session():
-    def __init__(self, ser=None, mode=None):
+    def __init__(self, ser=None, mode=None, recorder=None, clock=time):
         self.__serial = ser
         self.mode = mode
         self.__status = False
+        self.__recorder = recorder
+        self.clock = clock
+        self.parser = FrameParser()
+        self.__pending = deque()
+        self.credits = RX_WINDOW
+        self.overruns = 0   # OVERRUN reports from the gateway
+        self.overrun_cnt = 0
+        self.syn_frames = 0
+        self.__resync = False
+
+    def _record(self, direction, msg, kind=otcapture.FRAME):
+        if self.__recorder:
+            self.__recorder.record(direction, msg, kind)
 
     def init(self):
-        self.__serial.write(chr(SYN))
-        c = ord(self.__serial.read(1))
+        self.__serial.write(bytes([SYN]))
+        self._record(otcapture.HOST_TO_GW, SYN, otcapture.BYTE)
+        c = ENQ
+        while c == ENQ:  # ENQ's sent before the gateway saw the SYN
+            b = self.__serial.read(1)
+            if not b:
+                break
+            c = ord(b)
+            self._record(otcapture.GW_TO_HOST, c, otcapture.BYTE)
         if (c == ACK):
             self.__status = True
+            self.parser.reset()
+            self.credits = RX_WINDOW
+            self.__resync = False
         return self.__status
 
-    def read(self):
-        msg_in = bytearray([0, 0, 0, 0])
-        if self.__serial.readinto(msg_in) != 4:
+    def _fill(self):
+        """One read of everything the serial port has, at least a
+        frame. Returns the number of new frames."""
+        enq = self.parser.enq
+        n = min(max(_in_waiting(self.__serial), FRAME_BYTES), READ_CHUNK)
+        data = self.__serial.read(n)
+        if not data:
             raise GWIOException("Insufficient number of bytes read.")
-        return msg_in
+        frames = self.parser.feed(data)
+        for msg in frames:
+            self._record(otcapture.GW_TO_HOST, msg)
+            if (msg[0] & MSGID_MSK) == HOST_TO_GW:
+                if msg[1] == OVERRUN:
+                    # Frames in flight are lost, the gateway skips
+                    # everything up to a SYN frame and then grants new
+                    # credits.
+                    self.overruns += 1
+                    self.overrun_cnt = (msg[2] << 8) + msg[3]
+                    self._send_syn_frame()
+                    continue
+                if msg[1] == CREDIT and msg[2] == SYN:
+                    self.credits = msg[3]
+                    self.__resync = False
+                elif not self.__resync:
+                    self.credits = min(self.credits + 1, RX_WINDOW)
+                if msg[1] == CREDIT:
+                    continue
+            self.__pending.append(msg)
+        if self.parser.enq != enq and not frames:
+            self.__status = False
+            raise ProtocolException("Gateway is back in PASSTHRU mode.")
+        return len(frames)
+
+    def _send_syn_frame(self):
+        """Ask the gateway for all credits again, after an overrun or
+        when a credit or reply is overdue. It answers a SYN frame in any
+        state with CREDIT, SYN, RX_WINDOW."""
+        self.credits = 0
+        self.__resync = True
+        self.syn_frames += 1
+        self.__serial.write(SYN_FRAME)
+        for _ in SYN_FRAME:
+            self._record(otcapture.HOST_TO_GW, SYN, otcapture.BYTE)
+
+    def read_batch(self):
+        """All frames received so far, waits for at least one."""
+        while not self.__pending:
+            self._fill()
+        frames = list(self.__pending)
+        self.__pending.clear()
+        return frames
+
+    def read(self):
+        while not self.__pending:
+            self._fill()
+        return self.__pending.popleft()
 
     def read_test(self):
         return self.__serial.read(1024)
 
-    def _host_to_gw(self, cmd, msb=0, lsb=0):
-        msg_out = bytearray([HOST_TO_GW, cmd, msb, lsb])
-        msg_in = bytearray([0, 0, 0, 0])
-        rv = ()
-        self.__serial.write(msg_out)
+    def _send(self, msg):
+        """Write a frame as soon as the gateway has room for it."""
+        deadline = time() + CREDIT_TIMEOUT
+        while self.credits == 0:
+            if time() > deadline:
+                self._send_syn_frame()
+                deadline = time() + CREDIT_TIMEOUT
+            self._fill()
+        self.credits -= 1
+        self.__serial.write(msg)
         self.__serial.flush()
-        if self.__serial.readinto(msg_in) == 4:
-            return (msg_in[2], msg_in[3])
-        else:
-            raise GWIOException("Insufficient number of bytes read.")
+        self._record(otcapture.HOST_TO_GW, msg)
+
+    def send(self, msg):
+        """Send an OpenTherm frame to the thermostat or boiler. The
+        gateway adds the parity bit itself."""
+        msg = bytearray(msg)
+        msg[0] &= 0x7F
+        self._send(msg)
+
+    def _host_to_gw(self, cmd, msb=0, lsb=0):
+        """Send a command and wait for its reply. OpenTherm frames that
+        arrive in the mean time are kept for read(). An UNKNOWN_CMD
+        reply carries the command in msg[2], so a late one to an
+        earlier command is left alone."""
+        self._send(bytearray([HOST_TO_GW, cmd, msb, lsb]))
+        overruns = self.overruns
+        queued = len(self.__pending)
+        deadline = time() + CREDIT_TIMEOUT
+        while True:
+            while len(self.__pending) == queued and self.overruns == overruns:
+                if time() > deadline:
+                    self._send_syn_frame()  # the reply, and its credit, may be lost
+                    raise GWIOException("No reply to command 0x%02x." % cmd)
+                self._fill()
+            for k in range(queued, len(self.__pending)):
+                msg_in = self.__pending[k]
+                if (msg_in[0] & MSGID_MSK) == HOST_TO_GW and msg_in[1] == cmd:
+                    del self.__pending[k]
+                    return (msg_in[2], msg_in[3])
+                if (msg_in[0] & MSGID_MSK) == HOST_TO_GW and msg_in[1] == UNKNOWN_CMD and msg_in[2] == cmd:
+                    del self.__pending[k]
+                    raise UnknownCommand("Gateway does not know command 0x%02x." % cmd)
+            if self.overruns != overruns:
+                raise GWIOException("Command lost in gateway overrun.")
+            queued = len(self.__pending)
  
     def terminate(self):
         if self.__status:
             self._host_to_gw(EOS)
-            print "Clean termination."
+            print("Clean termination.")
             self.__status = False
         return self.__status
 
@@ -299,53 +573,132 @@ class Session():
     def set_t2_max(self, v):
         return self._set_value(SET_T2_MAX, v)
 
+    def get_t_glitch(self):
+        return self._get_value(GET_T_GLITCH)
 
-def session_handler(session):
-    t_min = 500
-    t_max = 900
-    t2_min = 1000
-    t2_max = 1800
+    def set_t_glitch(self, v):
+        return self._set_value(SET_T_GLITCH, v)
 
-    session.set_t_min(t_min)
-    session.set_t_max(t_max)
-    session.set_t2_min(t2_min)
-    session.set_t2_max(t2_max)
+    def get_glitch_cnt(self):
+        return self._get_value(GET_GLITCH_CNT)
 
-    old_time = time()
-    mode = session.mode
-    if mode == DO_MONITOR: 
-        session.do_monitor()
-    elif mode == DO_INTERCEPT:
-        session.do_intercept()
-    else:
-        exit(1)
+    def get_saved_cnt(self):
+        return self._get_value(GET_SAVED_CNT)
 
+    def get_overrun_cnt(self):
+        return self._get_value(GET_OVERRUN_CNT)
+
+
+async def set_windows(engine):
+    print("%ssession initiated." % (engine.name + "\t" if engine.name else ""))
+    await engine.set_value(SET_T_MIN, 500)
+    await engine.set_value(SET_T_MAX, 900)
+    await engine.set_value(SET_T2_MIN, 1000)
+    await engine.set_value(SET_T2_MAX, 1800)
+
+def print_frame(ts, msg):
+    print(format_frames([(ts, msg)])[0], flush=True)
+
+def write_frames(items, prefix=""):
+    sys.stdout.write("".join(prefix + line + "\n" for line in format_frames(items)))
+    sys.stdout.flush()
+
+async def print_frames(sub, prefix=""):
     while True:
-        try:
-            msg = session.read()
-            print "%s\t%s\t%s" % (repr_msg(msg), repr_data_id(msg), str(msg[2:]).encode("hex"))
-            if time() - old_time >= 6.0:
-                session.ping()  # keep alive ping
-                old_time = time()
-        except GWIOException, e:
-            print " * "
-        sys.stdout.flush()
-
-def main(ser, mode):
-    global session
-    while True:
-        c = ord(ser.read(1))
-        print "main: c = %i, ord(ENQ) = %i" % (c, ENQ)
-        if c == ENQ:
-            print "initialting session."
-            session = Session(ser, mode)
-            if session.init():
-                print "session initiated."
-                session_handler(session)
+        write_frames(await sub.get_batch(), prefix)
+
+def print_metrics(engines, elapsed, out=sys.stderr):
+    for e in engines:
+        m = e.metrics()
+        print("%s %s frames %i (%.1f/s) rx %i B sent %i cmds %i timeouts %i overruns %i "
+              "syn %i sessions %i lost %i resyncs %i dropped %i" % (
+                  e.name or "gw", m["state"], m["frames"], m["frames"] / max(elapsed, 1e-9),
+                  m["rx_bytes"], m["sent"], m["commands"], m["timeouts"], m["overruns"],
+                  m["syn_frames"], m["sessions"], m["lost_sessions"], m["resyncs"], m["dropped"]),
+              file=out)
+    out.flush()
+
+async def main(gateways, mode, clock=time, report=0):
+    """Run all gateways in one event loop. gateways is a list of (name,
+    serial port, recorder, store file); every gateway gets its own
+    engine, with its own session, keep-alive and command queue. With
+    more than one gateway output lines start with the name."""
+    import otengine
+
+    engines, printers, keepers = [], [], []
+    for name, ser, recorder, store in gateways:
+        engine = otengine.Engine(ser, mode, recorder, clock, setup=[set_windows],
+                                 name=name if len(gateways) > 1 else None)
+        sub = engine.subscribe()
+        prefix = engine.name + "\t" if engine.name else ""
+        printers.append((asyncio.ensure_future(print_frames(sub, prefix)), sub, prefix))
+        if store:
+            import otstore
+            keepers.append(otstore.Keeper(engine, store))
+        engines.append(engine)
+
+    async def close_all():
+        return await asyncio.gather(*(e.close() for e in engines))
+
+    async def reporter():
+        while True:
+            await asyncio.sleep(report)
+            print_metrics(engines, loop.time() - t0)
+
+    loop = asyncio.get_running_loop()
+    t0 = loop.time()
+    for sig in (signal.SIGINT, signal.SIGTERM):
+        loop.add_signal_handler(sig, lambda: asyncio.ensure_future(close_all()))
+    reporting = asyncio.ensure_future(reporter()) if report else None
+    done = None
+    try:
+        results = await asyncio.gather(*(e.run() for e in engines), return_exceptions=True)
+        for e, r in zip(engines, results):
+            if isinstance(r, otcapture.ReplayDone):
+                done = r
+            elif isinstance(r, BaseException):
+                print("%s stopped: %s" % (e.name or "gw", r), file=sys.stderr)
+    finally:
+        if reporting:
+            reporting.cancel()
+        for printer, sub, prefix in printers:
+            printer.cancel()
+            if len(sub):
+                write_frames(sub.drain(), prefix)
+        for keeper in keepers:
+            keeper.close()
+        if all(await close_all()):
+            print("Clean termination.")
+        if report:
+            import resource
+            print_metrics(engines, loop.time() - t0)
+            ru = resource.getrusage(resource.RUSAGE_SELF)
+            print("cpu %.2f s, max rss %i kB" % (ru.ru_utime + ru.ru_stime, ru.ru_maxrss),
+                  file=sys.stderr)
+    if done:
+        raise done
+
+def gateway_file(path, name, n):
+    """File per gateway: {name} in path is the name of the port."""
+    if path is None or "{name}" in path:
+        return path and path.format(name=name)
+    if n > 1:
+        raise ValueError("Use {name} in %s for more than one gateway." % path)
+    return path
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='OpenTherm host..')
     parser.add_argument("mode", help="Mode the gateway should use.")
+    parser.add_argument("--port", action="append",
+                        help="Serial port of a gateway, repeat for more gateways (/dev/ttyAMA0).")
+    parser.add_argument("--record", metavar="FILE", help="Append all frames to a capture file.")
+    parser.add_argument("--replay", metavar="FILE", help="Replay a capture instead of using the gateway.")
+    parser.add_argument("--speed", type=float, default=1.0,
+                        help="Replay speed, 1 = real time, 0 = as fast as possible.")
+    parser.add_argument("--store", metavar="FILE",
+                        help="Keep time series per DataID, snapshot in FILE.")
+    parser.add_argument("--report", type=float, default=0, metavar="S",
+                        help="Print metrics per gateway to stderr every S seconds.")
     args = parser.parse_args()
     mode = args.mode
     
@@ -356,12 +709,26 @@ if __name__ == '__main__':
     else:
         raise ValueError("Wrong mode.")
 
-    ser = serial.Serial("/dev/ttyAMA0", 115200, timeout=10)
+    clock = time
+    if args.replay:
+        capture = otcapture.Capture(args.replay)
+        sers = [("replay", otcapture.ReplaySerial(capture, args.speed))]
+        clock = sers[0][1].clock
+    else:
+        sers = [(os.path.basename(p), serial.Serial(p, 115200, timeout=0))
+                for p in args.port or ["/dev/ttyAMA0"]]
+    n = len(sers)
+    gateways = []
+    for name, ser in sers:
+        path = gateway_file(args.record, name, n)
+        gateways.append((name, ser, otcapture.Recorder(path, clock) if path else None,
+                         gateway_file(args.store, name, n)))
     try:
-        main(ser, nmode)
-    except KeyboardInterrupt:
-        pass
+        asyncio.run(main(gateways, nmode, clock, args.report))
+    except otcapture.ReplayDone:
+        print("Replay done, %i frames." % sers[0][1].delivered)
     finally:
-        if isinstance(session, Session):
-            session.terminate()
-    ser.close()
+        for name, ser, recorder, store in gateways:
+            if recorder:
+                recorder.close()
+            ser.close()
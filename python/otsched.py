@@ -0,0 +1,286 @@
+#!/usr/bin/env python3
+"""Polling scheduler for the host as OpenTherm master.
+
+In INTERCEPT mode the host can send its own READ_DATA requests to the
+boiler with Engine.send(). The bus only carries about one request per
+second, so the Scheduler decides which DataID goes in each slot:
+
+- Every DataID has a Poll with a base period and a priority. A slot
+  goes to the due Poll of the highest priority; within a priority the
+  most overdue one (time since the last request / period) goes first.
+- The period adapts to the value. A change halves it, down to
+  min_period; no change makes it 25% longer, up to max_period. A
+  value that changes often is read often, a constant one hardly.
+- A slot with nothing due is a spare slot. It goes to the most overdue
+  LOW priority Poll that is due, e.g. the counters 116 - 123, or else
+  reads the most overdue Poll of all early.
+- A DataID the boiler answers with UNKNOWN_DATAID is only tried again
+  after UNSUPPORTED_RETRY seconds.
+- A slave may take up to 800 ms to answer, so every request waits
+  REPLY_TIMEOUT for its reply and the budget is at most MAX_BUDGET.
+
+metrics() gives the freshness per DataID: age of the last value, age
+relative to the period and the number of requests, replies, changes
+and misses.
+
+Examples:
+
+  otsched.py --port /dev/ttyAMA0 --budget 1
+  otsched.py --port /tmp/otgw --report 10 -T 120
+"""
+
+import argparse
+import asyncio
+import signal
+import sys
+
+import otcodec
+import otengine
+import othost
+from othost import DO_INTERCEPT, GWIOException
+
+BUDGET = 1.0            # requests per second
+REPLY_TIMEOUT = 0.9     # 800 ms for the slave to answer, plus both frames
+MAX_BUDGET = 1.0        # REPLY_TIMEOUT plus 100 ms rest on the bus
+UNSUPPORTED_RETRY = 3600.0
+SHORTER = 0.5           # period factor after a change
+LONGER = 1.25           # period factor without a change
+
+# Priorities
+HIGH = 0
+NORMAL = 1
+LOW = 2                 # only in spare slots
+
+
+class Poll(object):
+    """Polling state of one DataID. Times are loop.time()."""
+
+    def __init__(self, data_id, period, priority=NORMAL, min_period=None, max_period=None,
+                 deadband=0.0):
+        self.data_id = data_id
+        self.base_period = period
+        self.period = period
+        self.priority = priority
+        self.min_period = period / 4 if min_period is None else min_period
+        self.max_period = period * 4 if max_period is None else max_period
+        self.deadband = deadband    # smaller changes do not count
+        self.value = None
+        self.raw = None
+        self.ts = None              # engine clock of the last value
+        self.last_request = None
+        self.last_reply = None
+        self.supported = True
+        self.requests = 0
+        self.replies = 0
+        self.changes = 0
+        self.misses = 0
+        self.invalid = 0
+
+    def age(self, now):
+        """Age of the value."""
+        return float("inf") if self.last_reply is None else now - self.last_reply
+
+    def staleness(self, now):
+        """Age of the value relative to the period, > 1 is overdue."""
+        return self.age(now) / self.period
+
+    def overdue(self, now):
+        """Time since the last request relative to the period. Used for
+        scheduling, so a DataID that gets no reply does not take every
+        slot."""
+        return float("inf") if self.last_request is None else (now - self.last_request) / self.period
+
+    def due(self, now):
+        if not self.supported:
+            return now - self.last_request >= UNSUPPORTED_RETRY
+        return self.overdue(now) >= 1
+
+    def update(self, now, ts, msg_type, raw, value):
+        """A reply came in. Only a valid ACK counts as a fresh value."""
+        if msg_type == otcodec.UNKNOWN_DATAID:
+            self.supported = False
+            return
+        self.supported = True
+        if msg_type == otcodec.DATA_INVALID:
+            self.invalid += 1
+            return
+        self.last_reply = now
+        self.ts = ts
+        self.replies += 1
+        if self.value is not None and abs(value - self.value) > self.deadband:
+            self.changes += 1
+            self.period = max(self.min_period, self.period * SHORTER)
+        elif self.value is not None:
+            self.period = min(self.max_period, self.period * LONGER)
+        self.value = value
+        self.raw = raw
+
+
+def default_polls():
+    """What a heating controller usually wants to know."""
+    polls = [Poll(0, 5, HIGH),          # Status
+             Poll(25, 10, HIGH),        # Tboiler
+             Poll(28, 10, HIGH),        # Tret
+             Poll(17, 10, HIGH),        # Rel.-mod-level
+             Poll(26, 30),              # Tdhw
+             Poll(18, 60),              # CH-pressure
+             Poll(27, 120),             # Toutside
+             Poll(5, 60)]               # ASF-flags / OEM-fault-code
+    polls += [Poll(i, 600, LOW) for i in range(116, 124)]   # counters
+    polls += [Poll(i, 3600, LOW) for i in (3, 125, 127)]    # config, versions
+    return polls
+
+
+class Scheduler(object):
+
+    def __init__(self, engine, polls=None, budget=BUDGET):
+        self.engine = engine
+        self.polls = dict((p.data_id, p) for p in (polls or default_polls()))
+        self.budget = min(budget, MAX_BUDGET)
+        self.stats = dict(slots=0, due=0, spare=0, idle=0)
+        self._pending = None        # Poll waiting for a reply
+        self._reply = None          # Future for the reply
+        self._sub = None
+        self._task = None
+        self._loop = None
+
+    def add(self, poll):
+        self.polls[poll.data_id] = poll
+
+    def next_poll(self, now):
+        """Poll for the next slot, or None."""
+        due = [p for p in self.polls.values() if p.priority != LOW and p.due(now)]
+        if due:
+            self.stats["due"] += 1
+            return min(due, key=lambda p: (p.priority, -p.overdue(now)))
+        low = [p for p in self.polls.values() if p.priority == LOW and p.due(now)]
+        spare = low or [p for p in self.polls.values() if p.supported]
+        if not spare:
+            return None
+        self.stats["spare"] += 1
+        return max(spare, key=lambda p: p.overdue(now))
+
+    def _on_frame(self, ts, msg):
+        msg_type, data_id, raw = otcodec.parse(msg)
+        p = self._pending
+        if p is None or msg_type < otcodec.READ_ACK or data_id != p.data_id:
+            return
+        p.update(self._loop.time(), ts, msg_type, raw, otcodec.value(msg))
+        self._pending = None
+        if not self._reply.done():
+            self._reply.set_result(True)
+
+    async def _run(self):
+        slot = 1.0 / self.budget
+        next_slot = self._loop.time()
+        while True:
+            await asyncio.sleep(max(0, next_slot - self._loop.time()))
+            next_slot += slot
+            now = self._loop.time()
+            if next_slot < now:     # behind, e.g. while the session was down
+                next_slot = now + slot
+            self.stats["slots"] += 1
+            if self.engine.state != otengine.RUNNING:
+                self.stats["idle"] += 1
+                continue
+            p = self.next_poll(now)
+            if p is None:
+                self.stats["idle"] += 1
+                continue
+            self._pending = p
+            self._reply = self._loop.create_future()
+            p.last_request = now
+            p.requests += 1
+            self.engine.send(otcodec.build(otcodec.READ_DATA, p.data_id, 0, with_parity=False))
+            try:
+                await asyncio.wait_for(self._reply, REPLY_TIMEOUT)
+            except asyncio.TimeoutError:
+                p.misses += 1
+                self._pending = None
+
+    def start(self):
+        self._loop = asyncio.get_running_loop()
+        self._sub = self.engine.consume(self._on_frame)
+        self._task = asyncio.ensure_future(self._run())
+
+    def stop(self):
+        if self._task:
+            self._task.cancel()
+            self._sub.close()
+
+    def metrics(self):
+        """Freshness per DataID, and a summary per priority."""
+        now = self._loop.time()
+        ids = {}
+        for i, p in sorted(self.polls.items()):
+            ids[i] = dict(value=p.value, age=p.age(now), period=p.period,
+                          staleness=p.staleness(now), requests=p.requests, replies=p.replies,
+                          changes=p.changes, misses=p.misses, supported=p.supported)
+        summary = {}
+        for prio in (HIGH, NORMAL, LOW):
+            s = [p.staleness(now) for p in self.polls.values() if p.priority == prio and p.supported]
+            if s:
+                summary[prio] = dict(max=max(s), mean=sum(s) / len(s),
+                                     overdue=sum(1 for x in s if x > 1))
+        return dict(ids=ids, priorities=summary, slots=dict(self.stats))
+
+
+def print_metrics(sched, out=sys.stdout):
+    m = sched.metrics()
+    names = ("HIGH", "NORMAL", "LOW")
+    print("%-30s %10s %8s %8s %6s %5s %5s %5s %5s" % (
+        "DataID", "value", "age", "period", "stale", "req", "rep", "chg", "miss"), file=out)
+    for i, d in m["ids"].items():
+        name = othost.data_id[i][0] if i in othost.data_id else str(i)
+        value = "-" if d["value"] is None else "%.2f" % d["value"]
+        if not d["supported"]:
+            value = "unsupported"
+        print("%3i %-26s %10s %8.1f %8.1f %6.2f %5i %5i %5i %5i" % (
+            i, name[:26], value, d["age"], d["period"], d["staleness"], d["requests"],
+            d["replies"], d["changes"], d["misses"]), file=out)
+    for prio, s in sorted(m["priorities"].items()):
+        print("%-6s staleness max %.2f mean %.2f overdue %i" % (
+            names[prio], s["max"], s["mean"], s["overdue"]), file=out)
+    print("slots %(slots)i due %(due)i spare %(spare)i idle %(idle)i" % m["slots"], file=out)
+    out.flush()
+
+
+async def main(args):
+    import serial
+
+    ser = serial.Serial(args.port, 115200, timeout=0)
+    engine = otengine.Engine(ser, DO_INTERCEPT, setup=[othost.set_windows])
+    sched = Scheduler(engine, budget=args.budget)
+    loop = asyncio.get_running_loop()
+    for sig in (signal.SIGINT, signal.SIGTERM):
+        loop.add_signal_handler(sig, lambda: asyncio.ensure_future(engine.close()))
+    if args.T:
+        loop.call_later(args.T, lambda: asyncio.ensure_future(engine.close()))
+
+    async def report():
+        while True:
+            await asyncio.sleep(args.report)
+            print_metrics(sched)
+
+    await engine.start()
+    sched.start()
+    reporter = asyncio.ensure_future(report())
+    try:
+        await engine.done
+    except GWIOException:
+        pass
+    finally:
+        reporter.cancel()
+        sched.stop()
+        print_metrics(sched)
+        await engine.close()
+        ser.close()
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Poll the boiler as OpenTherm master.")
+    parser.add_argument("--port", default="/dev/ttyAMA0", help="Serial port of the gateway.")
+    parser.add_argument("--budget", type=float, default=BUDGET, help="Requests per second, at most %.1f." % MAX_BUDGET)
+    parser.add_argument("--report", type=float, default=30, help="Seconds between metrics.")
+    parser.add_argument("-T", type=float, help="Stop after this many seconds.")
+    asyncio.run(main(parser.parse_args()))
@@ -0,0 +1,412 @@
+#!/usr/bin/env python3
+"""Fixed memory time series per DataID.
+
+The Store keeps the values the boiler reports (READ_ACK and WRITE_ACK)
+at three resolutions, each in a preallocated ring:
+
+  raw     every value, RAW_SIZE points per DataID
+  minute  min / max / mean / count per minute, MINUTE_SIZE points (2 days)
+  hour    min / max / mean / count per hour, HOUR_SIZE points (1 year)
+
+A ring overwrites its oldest point when full, so memory use is fixed
+per DataID (about 280 kB with the default sizes) however long the host
+runs. Values are decoded with otcodec (f8.8 etc.), frames are fed in
+batches from the engine; othost.py --store FILE keeps a Store with a
+snapshot in FILE. Only DataIDs with a 16 bit value (f8.8, u16, s16)
+are numbers that can be aggregated. DataIDs with two separate bytes,
+such as the flags of DataID 0, and unknown DataIDs keep the raw 16 bit
+value in the raw ring only.
+
+query() picks the finest resolution that still covers the start of the
+range and finds the range with a binary search. A snapshot is a compact
+binary file with the rings in order, written atomically:
+
+  header  "OTSTORE\\0", version, number of series
+  series  DataID, sizes and fill of the three rings, open buckets
+  data    the ring arrays, little endian
+
+Examples:
+
+  otstore.py import week.otc week.ots
+  otstore.py info week.ots
+  otstore.py query week.ots 25 --start 2015-03-01T12:00 --resolution minute
+"""
+
+import argparse
+import asyncio
+import os
+import struct
+import sys
+from array import array
+from datetime import datetime
+
+import otcapture
+import otcodec
+
+RAW_SIZE = 4096
+MINUTE_SIZE = 2 * 24 * 60
+HOUR_SIZE = 365 * 24
+
+MINUTE = 60
+HOUR = 3600
+SNAPSHOT_EVERY = 600.0   # s
+
+MAGIC = b"OTSTORE\x00"
+VERSION = 2                                 # 1 kept only the hb of two byte DataIDs
+HEADER = struct.Struct("<8sII")
+SERIES = struct.Struct("<IIIIIII")          # id, sizes and counts of the rings
+BUCKET = struct.Struct("<qdddI")            # open bucket: nr, min, max, sum, count
+
+STORED = (otcodec.READ_ACK, otcodec.WRITE_ACK)
+
+
+def numeric(data_id):
+    """Is the value of data_id one 16 bit number?"""
+    return otcodec.data_type(data_id) >> 4 == otcodec.WORD
+
+
+def _little(a):
+    if sys.byteorder != "little":
+        a.byteswap()
+    return a
+
+
+class Ring(object):
+    """Preallocated columns, one array per field, used as a ring. Points
+    are appended in time order, so the first column can be searched."""
+
+    def __init__(self, size, typecodes):
+        self.size = size
+        self.columns = [array(t, [0]) * size for t in typecodes]
+        self.head = 0       # next slot to write
+        self.count = 0
+
+    def append(self, *values):
+        h = self.head
+        for col, v in zip(self.columns, values):
+            col[h] = v
+        self.head = (h + 1) % self.size
+        if self.count < self.size:
+            self.count += 1
+
+    def _slot(self, i):
+        """Slot of the i-th oldest point."""
+        return (self.head - self.count + i) % self.size
+
+    def last(self, column=0):
+        return self.columns[column][self._slot(self.count - 1)] if self.count else None
+
+    def first(self, column=0):
+        return self.columns[column][self._slot(0)] if self.count else None
+
+    def bisect(self, key):
+        """Index of the first point with column 0 >= key."""
+        col = self.columns[0]
+        lo, hi = 0, self.count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if col[self._slot(mid)] < key:
+                lo = mid + 1
+            else:
+                hi = mid
+        return lo
+
+    def range(self, lo, hi):
+        """Points lo .. hi - 1 as one array per column, oldest first."""
+        out = []
+        a, b = self._slot(lo), self._slot(lo) + (hi - lo)
+        for col in self.columns:
+            if b <= self.size:
+                out.append(col[a:b])
+            else:
+                out.append(col[a:] + col[:b - self.size])
+        return out
+
+    def dump(self, f):
+        """All points, oldest first."""
+        for col in self.range(0, self.count):
+            _little(col).tofile(f)
+
+    def load(self, f, count):
+        for k, col in enumerate(self.columns):
+            a = array(col.typecode)
+            a.fromfile(f, count)
+            _little(a)
+            # Keep the newest points if the ring got smaller.
+            a = a[max(0, count - self.size):]
+            col[:len(a)] = a
+        self.count = min(count, self.size)
+        self.head = self.count % self.size
+
+
+class Bucket(object):
+    """Aggregate of the values in one minute or hour that is still open."""
+
+    __slots__ = ("nr", "min", "max", "sum", "count")
+
+    def __init__(self):
+        self.nr = -1
+        self.count = 0
+
+    def add(self, nr, v):
+        if self.count == 0:
+            self.nr = nr
+            self.min = self.max = self.sum = v
+            self.count = 1
+            return
+        if v < self.min:
+            self.min = v
+        if v > self.max:
+            self.max = v
+        self.sum += v
+        self.count += 1
+
+    def point(self, width):
+        return (self.nr * width, self.min, self.max, self.sum / self.count, self.count)
+
+
+class Series(object):
+    """Time series of one DataID. Without a numeric value only the raw
+    ring is used and it holds the raw 16 bit values."""
+
+    def __init__(self, data_id, raw_size=RAW_SIZE, minute_size=MINUTE_SIZE, hour_size=HOUR_SIZE):
+        self.data_id = data_id
+        self.numeric = numeric(data_id)
+        if not self.numeric:
+            minute_size = hour_size = 1
+        self.raw = Ring(raw_size, "df")                     # ts, value
+        self.minute = Ring(minute_size, "IfffI")            # start, min, max, mean, count
+        self.hour = Ring(hour_size, "IfffI")
+        self._open = ((self.minute, Bucket(), MINUTE), (self.hour, Bucket(), HOUR))
+
+    def add(self, ts, v):
+        last = self.raw.last()
+        if last is not None and ts < last:
+            ts = last   # keep time order for the binary search
+        self.raw.append(ts, v)
+        if not self.numeric:
+            return
+        for ring, bucket, width in self._open:
+            nr = int(ts // width)
+            if bucket.count and nr != bucket.nr:
+                ring.append(*bucket.point(width))
+                bucket.count = 0
+            bucket.add(nr, v)
+
+    def resolutions(self):
+        return dict(raw=self.raw, minute=self.minute, hour=self.hour)
+
+    def query(self, start=None, stop=None, resolution=None):
+        """Points with start <= ts < stop. raw gives (ts, value) arrays,
+        minute and hour (ts, min, max, mean, count) arrays including the
+        bucket that is still open. Without resolution the finest one
+        that goes back to start is used, raw only without a numeric
+        value. Returns (resolution, columns)."""
+        if not self.numeric:
+            resolution = "raw"
+        if resolution is None:
+            resolution = "hour"
+            for name in ("raw", "minute"):
+                ring = self.resolutions()[name]
+                complete = ring.count < ring.size   # nothing overwritten yet
+                if complete if start is None else ring.count and ring.first() <= start:
+                    resolution = name
+                    break
+        ring = self.resolutions()[resolution]
+        lo = 0 if start is None else ring.bisect(start)
+        hi = ring.count if stop is None else ring.bisect(stop)
+        cols = ring.range(lo, max(lo, hi))
+        if resolution != "raw":
+            ring_, bucket, width = self._open[0 if resolution == "minute" else 1]
+            if bucket.count:
+                p = bucket.point(width)
+                if (start is None or p[0] >= start) and (stop is None or p[0] < stop):
+                    for col, v in zip(cols, p):
+                        col.append(v)
+        return resolution, cols
+
+    def latest(self):
+        if not self.raw.count:
+            return None
+        return self.raw.last(0), self.raw.last(1)
+
+    def nbytes(self):
+        return sum(c.itemsize * len(c) for r in (self.raw, self.minute, self.hour) for c in r.columns)
+
+
+class Store(object):
+
+    def __init__(self, raw_size=RAW_SIZE, minute_size=MINUTE_SIZE, hour_size=HOUR_SIZE):
+        self.sizes = (raw_size, minute_size, hour_size)
+        self.series = {}
+        self.frames = 0
+
+    def get(self, data_id):
+        s = self.series.get(data_id)
+        if s is None:
+            s = self.series[data_id] = Series(data_id, *self.sizes)
+        return s
+
+    def add(self, data_id, ts, value):
+        self.get(data_id).add(ts, value)
+
+    def feed(self, items):
+        """Store a batch of (timestamp, frame) from the engine: the
+        value of numeric DataIDs, the raw value of the others."""
+        batch = otcodec.decode(b"".join(msg for ts, msg in items))
+        for k, (ts, msg) in enumerate(items):
+            if batch.type[k] in STORED:
+                s = self.get(batch.data_id[k])
+                s.add(ts, batch.value[k] if s.numeric else batch.raw[k])
+        self.frames += len(items)
+
+    def query(self, data_id, start=None, stop=None, resolution=None):
+        s = self.series.get(data_id)
+        return s.query(start, stop, resolution) if s else (resolution, [])
+
+    def nbytes(self):
+        return sum(s.nbytes() for s in self.series.values())
+
+    def save(self, path):
+        tmp = path + ".tmp"
+        with open(tmp, "wb") as f:
+            f.write(HEADER.pack(MAGIC, VERSION, len(self.series)))
+            for i, s in sorted(self.series.items()):
+                f.write(SERIES.pack(i, s.raw.size, s.raw.count, s.minute.size, s.minute.count,
+                                    s.hour.size, s.hour.count))
+                for ring, bucket, width in s._open:
+                    if bucket.count:
+                        f.write(BUCKET.pack(bucket.nr, bucket.min, bucket.max, bucket.sum, bucket.count))
+                    else:
+                        f.write(BUCKET.pack(-1, 0, 0, 0, 0))
+                for ring in (s.raw, s.minute, s.hour):
+                    ring.dump(f)
+            f.flush()
+            os.fsync(f.fileno())
+        os.replace(tmp, path)
+
+    @classmethod
+    def load(cls, path, **sizes):
+        """Store from a snapshot. The ring sizes are those of the new
+        Store, so they can be changed between runs."""
+        store = cls(**sizes)
+        with open(path, "rb") as f:
+            magic, version, n = HEADER.unpack(f.read(HEADER.size))
+            if magic != MAGIC or version not in (1, VERSION):
+                raise ValueError("%s is not a store snapshot." % path)
+            for _ in range(n):
+                i, _, raw_n, _, min_n, _, hour_n = SERIES.unpack(f.read(SERIES.size))
+                s = store.get(i)
+                for ring, bucket, width in s._open:
+                    nr, mn, mx, sm, cnt = BUCKET.unpack(f.read(BUCKET.size))
+                    if cnt:
+                        bucket.nr, bucket.min, bucket.max, bucket.sum, bucket.count = nr, mn, mx, sm, cnt
+                s.raw.load(f, raw_n)
+                s.minute.load(f, min_n)
+                s.hour.load(f, hour_n)
+                if version == 1 and not s.numeric:
+                    del store.series[i]     # only the hb, start over
+        return store
+
+
+class Keeper(object):
+    """Feeds a Store from an engine and saves a snapshot every
+    SNAPSHOT_EVERY seconds and on close(). An existing snapshot is
+    loaded first."""
+
+    def __init__(self, engine, path, every=SNAPSHOT_EVERY, **sizes):
+        self.path = path
+        self.every = every
+        self.store = Store.load(path, **sizes) if os.path.exists(path) else Store(**sizes)
+        self._sub = engine.subscribe()
+        self._task = asyncio.ensure_future(self._run())
+
+    async def _run(self):
+        loop = asyncio.get_running_loop()
+        next_save = loop.time() + self.every
+        while True:
+            self.store.feed(await self._sub.get_batch())
+            if loop.time() >= next_save:
+                self.store.save(self.path)
+                next_save = loop.time() + self.every
+
+    def close(self):
+        self._task.cancel()
+        self.store.feed(self._sub.drain())
+        self._sub.close()
+        self.store.save(self.path)
+
+
+def import_capture(path, store=None):
+    """Fill a Store from a capture file, frames from the gateway only."""
+    store = store or Store()
+    cap = otcapture.Capture(path)
+    items = []
+    for ts, d, k, frame in cap:
+        if d == otcapture.GW_TO_HOST and k == otcapture.FRAME and \
+           (frame[0] & otcapture.MSGID_MSK) != otcapture.MSG_HOST_TO_GW:
+            items.append((ts / 1e9, bytes(frame)))
+            if len(items) == 4096:
+                store.feed(items)
+                items = []
+    store.feed(items)
+    cap.close()
+    return store
+
+
+def _fmt_ts(ts):
+    return datetime.fromtimestamp(ts).isoformat(timespec="seconds")
+
+
+def _fmt_value(data_id, v):
+    """A stored value, the bytes apart when it is not numeric."""
+    if numeric(data_id):
+        return "%g" % v
+    msg = otcodec.build(otcodec.READ_ACK, data_id, int(v))
+    return otcodec.text(data_id, int(v), otcodec.value(msg), otcodec.value_lb(msg))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="OpenTherm time series store.")
+    sub = parser.add_subparsers(dest="action", required=True)
+    p = sub.add_parser("import", help="Build a snapshot from a capture file.")
+    p.add_argument("capture")
+    p.add_argument("snapshot")
+    p = sub.add_parser("info", help="Series in a snapshot.")
+    p.add_argument("snapshot")
+    p = sub.add_parser("query", help="Points of one DataID.")
+    p.add_argument("snapshot")
+    p.add_argument("data_id", type=int)
+    p.add_argument("--start", help="YYYY-MM-DDTHH:MM[:SS]")
+    p.add_argument("--stop", help="YYYY-MM-DDTHH:MM[:SS]")
+    p.add_argument("--resolution", choices=("raw", "minute", "hour"))
+    args = parser.parse_args()
+
+    if args.action == "import":
+        store = import_capture(args.capture)
+        store.save(args.snapshot)
+        print("%i frames, %i series, %i kB in memory, %i kB on disk" % (
+            store.frames, len(store.series), store.nbytes() // 1024,
+            os.path.getsize(args.snapshot) // 1024))
+        return
+    store = Store.load(args.snapshot)
+    if args.action == "info":
+        for i, s in sorted(store.series.items()):
+            latest = s.latest()
+            print("%3i  raw %5i  minute %5i  hour %5i  latest %s %s" % (
+                i, s.raw.count, s.minute.count, s.hour.count,
+                _fmt_ts(latest[0]), _fmt_value(i, latest[1])))
+    else:
+        start, stop = otcapture._parse_time(args.start), otcapture._parse_time(args.stop)
+        start = None if start is None else start / 1e9
+        stop = None if stop is None else stop / 1e9
+        resolution, cols = store.query(args.data_id, start, stop, args.resolution)
+        for point in zip(*cols):
+            if resolution == "raw":
+                print("%s\t%s" % (_fmt_ts(point[0]), _fmt_value(args.data_id, point[1])))
+            else:
+                print("%s\t%g\t%g\t%g\t%i" % ((_fmt_ts(point[0]),) + point[1:]))
+
+
+if __name__ == '__main__':
+    main()